@@ -4,10 +4,135 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <set>
-#include <map>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// build with -DSSHARP_PARSER_STATS=1 to count rule attempts in the Syntaxer and print them as JSON
+#ifndef SSHARP_PARSER_STATS
+#define SSHARP_PARSER_STATS 0
+#endif
+
+using std::string; using std::string_view; using std::vector; using std::istream; using std::move;
 
-using std::string; using std::vector; using std::istream; using std::move;
+/*
+ * Source - read-only program text. Regular files are memory mapped, anything else (pipes, terminals) is read into
+ * a single buffer. Tokens and parse tree nodes keep views into it, so it must outlive them. A mapping follows later
+ * writes to the file, so a caller that keeps views while the file may be edited asks for a copy with map false.
+ */
+class Source {
+    const char *first = nullptr;
+    size_t length = 0;
+    void *mapping = nullptr;
+    std::vector<char> buffer;
+    bool ok = false;
+
+    bool read_all(int fd);
+
+public:
+    explicit Source(const string &file_name, bool map = true);
+
+    Source(const Source &) = delete;
+
+    Source &operator=(const Source &) = delete;
+
+    ~Source();
+
+    bool valid() const { return ok; }
+
+    const char *begin() const { return first; }
+
+    const char *end() const { return first + length; }
+
+    size_t size() const { return length; }
+};
+
+Source::Source(const string &file_name, bool map) {
+    int fd = file_name == "-" ? STDIN_FILENO : open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st{};
+    if (map && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        length = (size_t) st.st_size;
+        if (length == 0) ok = true;
+        else if ((mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+            madvise(mapping, length, MADV_SEQUENTIAL);
+            first = (const char *) mapping;
+            ok = true;
+        } else {
+            mapping = nullptr;
+            length = 0;
+        }
+    }
+
+    if (!ok) ok = read_all(fd);
+    if (fd != STDIN_FILENO) close(fd);
+}
+
+bool Source::read_all(int fd) {
+    size_t used = 0;
+    buffer.resize(1 << 16);
+    while (true) {
+        if (used == buffer.size()) buffer.resize(buffer.size() * 2);
+        ssize_t n = read(fd, buffer.data() + used, buffer.size() - used);
+        if (n < 0) return false;
+        if (n == 0) break;
+        used += (size_t) n;
+    }
+    first = buffer.data();
+    length = used;
+    return true;
+}
+
+Source::~Source() {
+    if (mapping != nullptr) munmap(mapping, length);
+}
+
+/*
+ * Interner - gives every distinct identifier a dense 32-bit symbol id. Each name is copied once into storage owned
+ * by the interner, so ids and names stay valid independently of the source they were read from.
+ */
+class Interner {
+    std::unordered_map<string_view, uint32_t> ids;
+    std::deque<string> names;
+
+public:
+    static constexpr uint32_t none = UINT32_MAX;
+
+    uint32_t intern(string_view name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+
+        auto id = (uint32_t) names.size();
+        names.emplace_back(name);
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    string_view name(uint32_t id) const { return names[id]; }
+
+    uint32_t size() const { return (uint32_t) names.size(); }
+};
+
+class TokenQueue;
+
+class TokenStream;
 
 /*
  * Lexer - manages tokenization for Syntaxer
@@ -20,121 +145,853 @@ public:
     } Type;
 
     struct Token {
-        string value;
+        string_view value;
         Type type;
+        uint32_t symbol;
+        uint64_t literal;
 
         Token() {
             type = null;
             value = "";
+            symbol = Interner::none;
+            literal = 0;
         };
 
-        Token(string value, Type type) {
+        Token(string_view value, Type type, uint32_t symbol = Interner::none, uint64_t literal = 0) {
             this->value = value;
             this->type = type;
+            this->symbol = symbol;
+            this->literal = literal;
         }
     };
 
-    std::istream *buf;
+    /*
+     * Character classes and DFA states of the scanner. Every state accepts at most one token type, the scanner
+     * follows transitions until it reaches dead and emits the longest accepted prefix.
+     */
+    enum Class : uint8_t {
+        c_other, c_space, c_alpha, c_digit, c_lparen, c_rparen, c_lbrace, c_rbrace, c_times, c_slash,
+        c_plus, c_minus, c_mod, c_amp, c_bar, c_equal, c_bang, c_lss, c_gtr, c_semicolon, c_comma, class_count
+    };
 
-    std::vector<Token> tokens;
+    enum State : uint8_t {
+        s_start, s_ident, s_number, s_lparen, s_rparen, s_lbrace, s_rbrace, s_times, s_slash, s_plus,
+        s_minus, s_mod, s_amp, s_andsym, s_bar, s_orsym, s_equal, s_eql, s_bang, s_neq, s_lss, s_gtr, s_semicolon,
+        s_comma, s_dead, state_count
+    };
 
-    Lexer(std::istream &s);
+    struct Tables {
+        uint8_t classes[256];
+        uint8_t transitions[state_count][class_count];
+        Type accepts[state_count];
+    };
+
+    Lexer(const char *first, const char *last, Interner &symbols);
+
+    // lexes [first, last) of a larger buffer, offsets stay relative to base
+    Lexer(const char *base, const char *first, const char *last, Interner &symbols);
+
+    const char *error = nullptr;  // why analyse failed, and where
+    size_t error_offset = 0;
 
 private:
-    void skipws();
+    const char *base;
+    const char *cur;
+    const char *end;
+    Interner *symbols;
 
-    bool match(Token &);
+    void skipws();
 
     bool next(Token &);
 
+    bool fail(const char *message, const char *at);
+
 public:
 
     bool eof();
 
-    bool analyse(std::vector<Token> &);
+    bool analyse(TokenStream &);
+
+    bool analyse(TokenStream &, size_t max);
+
+    bool analyse(TokenQueue &);
+
+    bool finish();
 };
 
-Lexer::Lexer(std::istream &s) {
-    buf = &s;
-    tokens.emplace_back("(", lparen);
-    tokens.emplace_back(")", rparen);
-    tokens.emplace_back("{", lbrace);
-    tokens.emplace_back("}", rbrace);
-    tokens.emplace_back("*", times);
-    tokens.emplace_back("/", slash);
-    tokens.emplace_back("+", plus);
-    tokens.emplace_back("-", minus);
-    tokens.emplace_back("%", mod);
-    tokens.emplace_back("&&", andsym);
-    tokens.emplace_back("||", orsym);
-    tokens.emplace_back("==", eql);
-    tokens.emplace_back("!=", neq);
-    tokens.emplace_back("<", lss);
-    tokens.emplace_back(">", gtr);
-    tokens.emplace_back(";", semicolon);
-    tokens.emplace_back(",", comma);
-    tokens.emplace_back("if", ifsym);
-    tokens.emplace_back("!", negation);
-    tokens.emplace_back("", ident);
-    tokens.emplace_back("", number);
-}
-
-void Lexer::skipws() { while (isspace(buf->peek())) buf->get(); }
-
-bool Lexer::match(Lexer::Token &token) {
-    skipws();
-    auto pos = buf->tellg();
-
-    string s;
-    if (token.type == ident || token.type == number) {
-        while ((token.type == ident ? isalpha(buf->peek()) : isdigit(buf->peek())))
-            s += (char) buf->get(); // TODO - inefficient
-        if (!s.empty()) {
-            token.value = s;
-            return true;
+/*
+ * TokenStream - compact struct-of-arrays token store. Every token is a one-byte type plus a 32-bit word, which is
+ * the source offset for fixed tokens and an index into the payload table for identifiers and numbers. Payloads
+ * carry the offset and length of those tokens and their symbol or literal value. Token views are rebuilt on demand
+ * from the source base. Indices are absolute: release() drops a prefix that is no longer needed without renumbering
+ * the tokens after it.
+ */
+class TokenStream {
+public:
+    struct Payload {
+        uint32_t offset;
+        uint32_t length;
+        uint64_t data;  // symbol of an identifier, value of a number
+    };
+
+    static constexpr uint8_t fixed_length[] = {0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 1, 1, 1, 1, 2, 1, 0, 0};
+
+    const char *base = nullptr;
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> words;
+    std::vector<Payload> payloads;
+    size_t first = 0;          // absolute index of types[0]
+    size_t first_payload = 0;  // absolute index of payloads[0]
+
+    TokenStream() = default;
+
+    explicit TokenStream(const char *base) { this->base = base; }
+
+    static bool has_payload(Lexer::Type type) { return type == Lexer::ident || type == Lexer::number; }
+
+    // absolute index one past the last token
+    size_t size() const { return first + types.size(); }
+
+    bool empty() const { return types.empty(); }
+
+    void reserve(size_t n) {
+        types.reserve(n);
+        words.reserve(n);
+    }
+
+    // copy of the tokens [from, to), at the same absolute indices
+    TokenStream slice(size_t from, size_t to) const {
+        TokenStream part(base);
+        part.first = from;
+        part.types.assign(types.begin() + (std::ptrdiff_t) (from - first), types.begin() + (std::ptrdiff_t) (to - first));
+        part.words.assign(words.begin() + (std::ptrdiff_t) (from - first), words.begin() + (std::ptrdiff_t) (to - first));
+
+        size_t i = from, j = to;
+        while (i < to && !has_payload(type(i))) i++;
+        while (j > i && !has_payload(type(j - 1))) j--;
+        if (i < j) {
+            part.first_payload = words[i - first];
+            part.payloads.assign(payloads.begin() + (std::ptrdiff_t) (words[i - first] - first_payload),
+                                 payloads.begin() + (std::ptrdiff_t) (words[j - 1 - first] - first_payload + 1));
         }
-    } else {
-        while (buf->peek() == token.value[buf->tellg() - pos]) {
-            s += string(1, buf->get());
-            if (s.size() == token.value.size()) return true;
+        return part;
+    }
+
+    void push(const Lexer::Token &token) {
+        auto offset = (uint32_t) (token.value.data() - base);
+        types.push_back(token.type);
+        if (has_payload(token.type)) {
+            words.push_back((uint32_t) (first_payload + payloads.size()));
+            payloads.push_back({offset, (uint32_t) token.value.size(),
+                                token.type == Lexer::ident ? token.symbol : token.literal});
+        } else words.push_back(offset);
+    }
+
+    void append(const TokenStream &other) {
+        if (empty()) base = other.base;
+        auto shift = (uint32_t) (first_payload + payloads.size() - other.first_payload);
+        types.insert(types.end(), other.types.begin(), other.types.end());
+        for (size_t i = 0; i < other.types.size(); ++i)
+            words.push_back(has_payload((Lexer::Type) other.types[i]) ? other.words[i] + shift : other.words[i]);
+        payloads.insert(payloads.end(), other.payloads.begin(), other.payloads.end());
+    }
+
+    // Drops the tokens before absolute index upto. Storage is compacted once the dropped prefix is at least as long
+    // as what is kept, so the cost is amortised and memory stays proportional to the retained window.
+    void release(size_t upto) {
+        size_t dead = upto - first;
+        if (dead < 4096 || dead < types.size() - dead) return;
+
+        size_t dead_payloads = 0;
+        for (size_t i = 0; i < dead; ++i) dead_payloads += has_payload((Lexer::Type) types[i]);
+
+        types.erase(types.begin(), types.begin() + dead);
+        words.erase(words.begin(), words.begin() + dead);
+        payloads.erase(payloads.begin(), payloads.begin() + dead_payloads);
+        first += dead;
+        first_payload += dead_payloads;
+    }
+
+    Lexer::Type type(size_t i) const { return (Lexer::Type) types[i - first]; }
+
+    Lexer::Token token(size_t i) const {
+        auto t = type(i);
+        uint32_t word = words[i - first];
+        if (!has_payload(t)) return Lexer::Token(string_view(base + word, fixed_length[t]), t);
+        const Payload &p = payloads[word - first_payload];
+        string_view value(base + p.offset, p.length);
+        if (t == Lexer::ident) return Lexer::Token(value, t, (uint32_t) p.data);
+        return Lexer::Token(value, t, Interner::none, p.data);
+    }
+};
+
+constexpr Lexer::Tables make_lexer_tables() {
+    Lexer::Tables t{};
+
+    for (int c = 0; c < 256; ++c) {
+        Lexer::Class k = Lexer::c_other;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) k = Lexer::c_space;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) k = Lexer::c_alpha;
+        else if (c >= '0' && c <= '9') k = Lexer::c_digit;
+        t.classes[c] = k;
+    }
+    t.classes['('] = Lexer::c_lparen;
+    t.classes[')'] = Lexer::c_rparen;
+    t.classes['{'] = Lexer::c_lbrace;
+    t.classes['}'] = Lexer::c_rbrace;
+    t.classes['*'] = Lexer::c_times;
+    t.classes['/'] = Lexer::c_slash;
+    t.classes['+'] = Lexer::c_plus;
+    t.classes['-'] = Lexer::c_minus;
+    t.classes['%'] = Lexer::c_mod;
+    t.classes['&'] = Lexer::c_amp;
+    t.classes['|'] = Lexer::c_bar;
+    t.classes['='] = Lexer::c_equal;
+    t.classes['!'] = Lexer::c_bang;
+    t.classes['<'] = Lexer::c_lss;
+    t.classes['>'] = Lexer::c_gtr;
+    t.classes[';'] = Lexer::c_semicolon;
+    t.classes[','] = Lexer::c_comma;
+
+    for (int s = 0; s < Lexer::state_count; ++s) {
+        for (int c = 0; c < Lexer::class_count; ++c) t.transitions[s][c] = Lexer::s_dead;
+        t.accepts[s] = Lexer::null;
+    }
+
+    auto &start = t.transitions[Lexer::s_start];
+    start[Lexer::c_alpha] = Lexer::s_ident;
+    start[Lexer::c_digit] = Lexer::s_number;
+    start[Lexer::c_lparen] = Lexer::s_lparen;
+    start[Lexer::c_rparen] = Lexer::s_rparen;
+    start[Lexer::c_lbrace] = Lexer::s_lbrace;
+    start[Lexer::c_rbrace] = Lexer::s_rbrace;
+    start[Lexer::c_times] = Lexer::s_times;
+    start[Lexer::c_slash] = Lexer::s_slash;
+    start[Lexer::c_plus] = Lexer::s_plus;
+    start[Lexer::c_minus] = Lexer::s_minus;
+    start[Lexer::c_mod] = Lexer::s_mod;
+    start[Lexer::c_amp] = Lexer::s_amp;
+    start[Lexer::c_bar] = Lexer::s_bar;
+    start[Lexer::c_equal] = Lexer::s_equal;
+    start[Lexer::c_bang] = Lexer::s_bang;
+    start[Lexer::c_lss] = Lexer::s_lss;
+    start[Lexer::c_gtr] = Lexer::s_gtr;
+    start[Lexer::c_semicolon] = Lexer::s_semicolon;
+    start[Lexer::c_comma] = Lexer::s_comma;
+
+    t.transitions[Lexer::s_ident][Lexer::c_alpha] = Lexer::s_ident;
+    t.transitions[Lexer::s_number][Lexer::c_digit] = Lexer::s_number;
+    t.transitions[Lexer::s_amp][Lexer::c_amp] = Lexer::s_andsym;
+    t.transitions[Lexer::s_bar][Lexer::c_bar] = Lexer::s_orsym;
+    t.transitions[Lexer::s_equal][Lexer::c_equal] = Lexer::s_eql;
+    t.transitions[Lexer::s_bang][Lexer::c_equal] = Lexer::s_neq;
+
+    t.accepts[Lexer::s_ident] = Lexer::ident;
+    t.accepts[Lexer::s_number] = Lexer::number;
+    t.accepts[Lexer::s_lparen] = Lexer::lparen;
+    t.accepts[Lexer::s_rparen] = Lexer::rparen;
+    t.accepts[Lexer::s_lbrace] = Lexer::lbrace;
+    t.accepts[Lexer::s_rbrace] = Lexer::rbrace;
+    t.accepts[Lexer::s_times] = Lexer::times;
+    t.accepts[Lexer::s_slash] = Lexer::slash;
+    t.accepts[Lexer::s_plus] = Lexer::plus;
+    t.accepts[Lexer::s_minus] = Lexer::minus;
+    t.accepts[Lexer::s_mod] = Lexer::mod;
+    t.accepts[Lexer::s_andsym] = Lexer::andsym;
+    t.accepts[Lexer::s_orsym] = Lexer::orsym;
+    t.accepts[Lexer::s_eql] = Lexer::eql;
+    t.accepts[Lexer::s_bang] = Lexer::negation;
+    t.accepts[Lexer::s_neq] = Lexer::neq;
+    t.accepts[Lexer::s_lss] = Lexer::lss;
+    t.accepts[Lexer::s_gtr] = Lexer::gtr;
+    t.accepts[Lexer::s_semicolon] = Lexer::semicolon;
+    t.accepts[Lexer::s_comma] = Lexer::comma;
+
+    return t;
+}
+
+static constexpr Lexer::Tables lexer_tables = make_lexer_tables();
+
+/*
+ * Keywords - identifiers are lexed by maximal munch and then classified with a perfect hash built at compile time.
+ * The hash runs over every byte of the identifier; make_keyword_table searches for a multiplier that gives every
+ * keyword its own slot, so a lookup is one hash of the word and at most one string compare.
+ */
+struct Keyword {
+    string_view text;
+    Lexer::Type type;
+};
+
+static constexpr Keyword keywords[] = {
+        {"if", Lexer::ifsym},
+};
+
+struct KeywordTable {
+    static constexpr uint32_t bits = 4;  // 16 slots
+    uint32_t seed;
+    int8_t slots[1u << bits];
+    bool perfect;
+};
+
+constexpr uint32_t keyword_slot(uint32_t seed, string_view s) {
+    uint32_t key = 0x811c9dc5u;
+    for (char c : s) key = (key ^ (unsigned char) c) * 0x01000193u;
+    return ((key ^ key >> 15) * seed) >> (32 - KeywordTable::bits);
+}
+
+constexpr KeywordTable make_keyword_table() {
+    KeywordTable t{};
+    for (uint32_t seed = 0x9E3779B1u, tries = 0; tries < 256; seed += 2, ++tries) {
+        t.seed = seed;
+        for (auto &slot : t.slots) slot = -1;
+
+        t.perfect = true;
+        for (int k = 0; t.perfect && k < (int) (sizeof(keywords) / sizeof(keywords[0])); ++k) {
+            auto &slot = t.slots[keyword_slot(seed, keywords[k].text)];
+            if (slot >= 0) t.perfect = false;
+            else slot = (int8_t) k;
         }
+        if (t.perfect) return t;
     }
+    return t;
+}
 
-    buf->seekg(pos);
-    return false;
+static constexpr KeywordTable keyword_table = make_keyword_table();
+static_assert(keyword_table.perfect, "no seed separates the keywords, grow KeywordTable::bits");
+
+inline Lexer::Type keyword_type(string_view s) {
+    int k = keyword_table.slots[keyword_slot(keyword_table.seed, s)];
+    return k >= 0 && keywords[k].text == s ? keywords[k].type : Lexer::ident;
+}
+
+/*
+ * Run scanners - find the end of a run of whitespace, letters or digits. The vector versions classify 16 (SSE2) or
+ * 32 (AVX2) bytes per step with ASCII range masks and finish the tail with the scalar loop. The widest version the
+ * CPU supports is picked once at startup.
+ */
+typedef enum { run_space, run_alpha, run_digit } RunClass;
+
+struct RunScanners {
+    typedef const char *(*Scan)(const char *, const char *);
+    Scan space, alpha, digit;
+};
+
+template<RunClass Run>
+const char *scan_run_scalar(const char *p, const char *end) {
+    for (; p != end; ++p) {
+        uint8_t k = lexer_tables.classes[(unsigned char) *p];
+        bool in = Run == run_space ? k == Lexer::c_space :
+                  Run == run_digit ? k == Lexer::c_digit :
+                  k == Lexer::c_alpha;
+        if (!in) break;
+    }
+    return p;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define LEXER_SIMD 1
+
+// signed byte compares are fine here: bytes >= 0x80 are negative and fall outside every ASCII range
+template<RunClass Run>
+__attribute__((target("sse2"))) inline __m128i run_mask_sse2(__m128i v) {
+    if (Run == run_space)
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                            _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1))));
+    if (Run == run_digit)
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    v = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+}
+
+template<RunClass Run>
+__attribute__((target("sse2"))) const char *scan_run_sse2(const char *p, const char *end) {
+    while (end - p >= 16) {
+        auto mask = (uint32_t) _mm_movemask_epi8(run_mask_sse2<Run>(_mm_loadu_si128((const __m128i *) p)));
+        if (mask != 0xFFFF) return p + __builtin_ctz(~mask);
+        p += 16;
+    }
+    return scan_run_scalar<Run>(p, end);
+}
+
+template<RunClass Run>
+__attribute__((target("avx2"))) inline __m256i run_mask_avx2(__m256i v) {
+    if (Run == run_space)
+        return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                               _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                                                _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v)));
+    if (Run == run_digit)
+        return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    v = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+}
+
+template<RunClass Run>
+__attribute__((target("avx2"))) const char *scan_run_avx2(const char *p, const char *end) {
+    while (end - p >= 32) {
+        auto mask = (uint32_t) _mm256_movemask_epi8(run_mask_avx2<Run>(_mm256_loadu_si256((const __m256i *) p)));
+        if (mask != 0xFFFFFFFF) return p + __builtin_ctz(~mask);
+        p += 32;
+    }
+    return scan_run_sse2<Run>(p, end);
+}
+#endif
+
+static RunScanners select_run_scanners() {
+#ifdef LEXER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {scan_run_avx2<run_space>, scan_run_avx2<run_alpha>, scan_run_avx2<run_digit>};
+    if (__builtin_cpu_supports("sse2"))
+        return {scan_run_sse2<run_space>, scan_run_sse2<run_alpha>, scan_run_sse2<run_digit>};
+#endif
+    return {scan_run_scalar<run_space>, scan_run_scalar<run_alpha>, scan_run_scalar<run_digit>};
 }
 
+static const RunScanners run_scanners = select_run_scanners();
+
+/*
+ * Number literals - digit runs are converted while lexing, eight digits at a time with SWAR arithmetic: the digits
+ * are loaded as one little-endian word and combined pairwise into 2, 4 and finally 8 digit values.
+ */
+inline uint32_t parse_eight_digits(const char *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = ((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+         ((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >> 32;
+    return (uint32_t) v;
+#else
+    uint32_t v = 0;
+    for (int i = 0; i < 8; ++i) v = v * 10 + (uint32_t) (p[i] - '0');
+    return v;
+#endif
+}
+
+// false when the digits do not fit into uint64_t
+inline bool parse_number(const char *p, const char *end, uint64_t &value) {
+    while (end - p > 1 && *p == '0') p++;
+    if (end - p > 20) return false;
+
+    value = 0;
+    for (; end - p >= 8; p += 8)
+        if (__builtin_mul_overflow(value, 100000000ULL, &value) ||
+            __builtin_add_overflow(value, parse_eight_digits(p), &value))
+            return false;
+    for (; p != end; ++p)
+        if (__builtin_mul_overflow(value, 10ULL, &value) || __builtin_add_overflow(value, *p - '0', &value))
+            return false;
+    return true;
+}
+
+Lexer::Lexer(const char *first, const char *last, Interner &symbols) : Lexer(first, first, last, symbols) {}
+
+Lexer::Lexer(const char *base, const char *first, const char *last, Interner &symbols) {
+    this->base = base;
+    cur = first;
+    end = last;
+    this->symbols = &symbols;
+}
+
+void Lexer::skipws() { cur = run_scanners.space(cur, end); }
+
 bool Lexer::next(Token &token) {
-    for (const auto &i : tokens) {
-        token = i;
-        if (match(token))
-            return true;
+    skipws();
+
+    uint8_t state = s_start;
+    Type accepted = null;
+    const char *accepted_end = cur;
+
+    for (const char *p = cur; p != end; ++p) {
+        state = lexer_tables.transitions[state][lexer_tables.classes[(unsigned char) *p]];
+        if (state == s_dead) break;
+        if (lexer_tables.accepts[state] != null) {
+            accepted = lexer_tables.accepts[state];
+            accepted_end = p + 1;
+        }
+        // identifier and number states only loop on their own class, so the rest of the run is consumed in bulk
+        if (state == s_ident) {
+            accepted_end = run_scanners.alpha(p + 1, end);
+            break;
+        }
+        if (state == s_number) {
+            accepted_end = run_scanners.digit(p + 1, end);
+            break;
+        }
     }
+
+    if (accepted == null) return cur != end ? fail("unexpected character", cur) : false;
+
+    string_view value(cur, accepted_end - cur);
+    if (accepted == ident) {
+        accepted = keyword_type(value);
+        token = Token(value, accepted, accepted == ident ? symbols->intern(value) : Interner::none);
+    } else if (accepted == number) {
+        uint64_t literal;
+        if (!parse_number(cur, accepted_end, literal)) return fail("number literal out of range", cur);
+        token = Token(value, accepted, Interner::none, literal);
+    } else token = Token(value, accepted);
+
+    cur = accepted_end;
+    return true;
+}
+
+bool Lexer::fail(const char *message, const char *at) {
+    error = message;
+    error_offset = (size_t) (at - base);
     return false;
 }
 
 bool Lexer::eof() {
     skipws();
-    return buf->eof() || buf->peek() == EOF;
+    return cur == end;
 }
 
-bool Lexer::analyse(std::vector<Lexer::Token> &tokens) {
+bool Lexer::analyse(TokenStream &tokens) {
     Token t;
-    while (next(t)) tokens.push_back(t);
+    while (next(t)) tokens.push(t);
     return eof();
 }
 
+// Lexes at most max more tokens, returns false once the input is used up or an error is hit.
+bool Lexer::analyse(TokenStream &tokens, size_t max) {
+    Token t;
+    for (size_t n = 0; n < max; ++n) {
+        if (!next(t)) return false;
+        tokens.push(t);
+    }
+    return true;
+}
+
+// Scans whatever was not requested, so lexical errors past the point where parsing stopped are still reported.
+bool Lexer::finish() {
+    Token t;
+    while (next(t));
+    return eof();
+}
+
+/*
+ * TokenQueue - bounded lock-free single-producer/single-consumer ring of token batches. It lets the Lexer run on
+ * its own thread while the Syntaxer consumes what has been lexed so far.
+ */
+class TokenQueue {
+public:
+    typedef TokenStream Batch;
+
+    static constexpr size_t capacity = 64;  // batches, power of two
+    static constexpr size_t batch_size = 4096;
+
+private:
+    Batch slots[capacity];
+    alignas(64) std::atomic<size_t> head{0};  // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail{0};  // next slot to push, written by the producer
+    alignas(64) std::atomic<bool> closed{false};
+    std::atomic<bool> cancelled{false};
+
+public:
+    // Producer side. Returns false when the consumer has given up and the rest of the input is not wanted.
+    bool push(Batch &&batch) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        while (t - head.load(std::memory_order_acquire) == capacity) {
+            if (cancelled.load(std::memory_order_relaxed)) return false;
+            std::this_thread::yield();
+        }
+        slots[t & (capacity - 1)] = move(batch);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    void close() { closed.store(true, std::memory_order_release); }
+
+    // Consumer side. Blocks until a batch is available, returns false once the producer has closed the queue.
+    bool pop(Batch &batch) {
+        size_t h = head.load(std::memory_order_relaxed);
+        while (h == tail.load(std::memory_order_acquire)) {
+            if (closed.load(std::memory_order_acquire) && h == tail.load(std::memory_order_acquire)) return false;
+            std::this_thread::yield();
+        }
+        batch = move(slots[h & (capacity - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+};
+
+bool Lexer::analyse(TokenQueue &queue) {
+    TokenQueue::Batch batch(base);
+    batch.reserve(TokenQueue::batch_size);
+
+    // once the consumer cancels, the rest is still scanned so lexical errors are reported as in serial mode
+    Token t;
+    bool wanted = true;
+    while (next(t)) {
+        if (!wanted) continue;
+        batch.push(t);
+        if (batch.size() == TokenQueue::batch_size) {
+            wanted = queue.push(move(batch));
+            batch = TokenQueue::Batch(base);
+            batch.reserve(TokenQueue::batch_size);
+        }
+    }
+    if (wanted && !batch.empty()) queue.push(move(batch));
+    queue.close();
+
+    return eof();
+}
+
+/*
+ * parallel_for - runs f(0) ... f(tasks - 1) on up to jobs threads, the calling thread included. Every thread starts
+ * with an equal slice of the indices and takes them from the front. A thread that runs dry steals the back half of
+ * the largest slice left, so tasks of uneven cost still keep all threads busy.
+ */
+template<typename F>
+void parallel_for(size_t tasks, unsigned jobs, F &&f) {
+    size_t n = std::max<size_t>(1, std::min<size_t>(jobs, tasks));
+
+    // [begin, end) of each thread's slice, packed into one word so that owner and thief update it atomically
+    auto pack = [](uint64_t begin, uint64_t end) { return begin << 32 | end; };
+    auto begin = [](uint64_t slice) { return slice >> 32; };
+    auto end = [](uint64_t slice) { return slice & 0xffffffffu; };
+    std::vector<std::atomic<uint64_t>> slices(n);
+    for (size_t j = 0; j < n; ++j) slices[j] = pack(tasks * j / n, tasks * (j + 1) / n);
+
+    auto worker = [&](size_t self) {
+        while (true) {
+            uint64_t slice = slices[self].load();
+            while (begin(slice) < end(slice))
+                if (slices[self].compare_exchange_weak(slice, pack(begin(slice) + 1, end(slice)))) {
+                    f(begin(slice));
+                    slice = slices[self].load();
+                }
+
+            size_t victim = self;
+            uint64_t most = 0;
+            for (size_t j = 0; j < n; ++j) {
+                uint64_t other = slices[j].load();
+                if (end(other) - begin(other) > most) {
+                    victim = j;
+                    most = end(other) - begin(other);
+                    slice = other;
+                }
+            }
+            if (most == 0) return;
+
+            // only thieves write to an empty slice, and they skip it, so the owner can refill its own with a store
+            uint64_t half = (most + 1) / 2;
+            if (slices[victim].compare_exchange_strong(slice, pack(begin(slice), end(slice) - half)))
+                slices[self].store(pack(end(slice) - half, end(slice)));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t j = 1; j < n; ++j) threads.emplace_back(worker, j);
+    worker(0);
+    for (auto &t : threads) t.join();
+}
+
+/*
+ * ParallelLexer - S# has no string literals or comments, so the source can be cut at any whitespace and the pieces
+ * lexed independently. Every chunk gets its own Lexer and Interner. The chunks are then joined in order and their
+ * symbols renumbered into the shared Interner, which yields exactly the ids and tokens of a serial Lexer.
+ */
+class ParallelLexer {
+    struct Chunk {
+        const char *first = nullptr;
+        const char *last = nullptr;
+        Interner symbols;
+        TokenStream tokens;
+        bool ok = false;
+        const char *error = nullptr;
+        size_t error_offset = 0;
+    };
+
+    static constexpr size_t min_chunk = 1 << 16;
+
+    const char *base;
+    std::vector<Chunk> chunks;
+    unsigned jobs;
+
+public:
+    const char *error = nullptr;
+    size_t error_offset = 0;
+
+    ParallelLexer(const char *first, const char *last, unsigned jobs);
+
+    bool analyse(TokenStream &tokens, Interner &symbols);
+};
+
+ParallelLexer::ParallelLexer(const char *first, const char *last, unsigned jobs) : chunks(std::max<size_t>(
+        1, std::min<size_t>(jobs, (size_t) (last - first) / min_chunk))) {
+    base = first;
+    this->jobs = jobs;
+
+    size_t n = chunks.size();
+    const char *cut = first;
+    for (size_t i = 0; i < n; ++i) {
+        chunks[i].first = cut;
+        cut = i + 1 == n ? last : std::max(cut, first + (last - first) * (i + 1) / n);
+        while (cut != last && lexer_tables.classes[(unsigned char) *cut] != Lexer::c_space) cut++;
+        chunks[i].last = cut;
+    }
+}
+
+bool ParallelLexer::analyse(TokenStream &tokens, Interner &symbols) {
+    parallel_for(chunks.size(), jobs, [&](size_t i) {
+        Chunk &chunk = chunks[i];
+        chunk.tokens = TokenStream(base);
+        chunk.tokens.reserve((size_t) (chunk.last - chunk.first) / 4);
+
+        Lexer lexer(base, chunk.first, chunk.last, chunk.symbols);
+        chunk.ok = lexer.analyse(chunk.tokens);
+        chunk.error = lexer.error;
+        chunk.error_offset = lexer.error_offset;
+    });
+
+    tokens.reserve(tokens.size() + std::accumulate(chunks.begin(), chunks.end(), (size_t) 0,
+                                                   [](size_t n, const Chunk &c) { return n + c.tokens.size(); }));
+
+    std::vector<uint32_t> remap;
+    for (auto &chunk : chunks) {
+        if (!chunk.ok) {
+            error = chunk.error;
+            error_offset = chunk.error_offset;
+            return false;
+        }
+
+        remap.resize(chunk.symbols.size());
+        for (uint32_t id = 0; id < chunk.symbols.size(); ++id) remap[id] = symbols.intern(chunk.symbols.name(id));
+        for (size_t i = 0; i < chunk.tokens.types.size(); ++i)
+            if (chunk.tokens.types[i] == Lexer::ident) {
+                auto &payload = chunk.tokens.payloads[chunk.tokens.words[i]];
+                payload.data = remap[payload.data];
+            }
+
+        tokens.append(chunk.tokens);
+        chunk.tokens = TokenStream();
+    }
+    return true;
+}
+
+/*
+ * Arena - bump-pointer allocator for parse tree nodes. Objects placed in it must be trivially destructible: a failed
+ * rule attempt rolls the arena back to a mark, and everything is released at once when the arena goes away.
+ */
+class Arena {
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    static constexpr size_t first_block = 1 << 16;
+    static constexpr size_t max_block = 1 << 24;
+
+    std::vector<Block> blocks;
+    size_t current = 0;  // block being filled
+    size_t used = 0;     // bytes used in it
+    std::vector<std::shared_ptr<Arena>> adopted;
+
+public:
+    struct Mark {
+        size_t block;
+        size_t used;
+    };
+
+    Arena() = default;
+
+    Arena(const Arena &) = delete;
+
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t bytes, size_t align) {
+        size_t start = (used + align - 1) & ~(align - 1);
+        if (blocks.empty() || start + bytes > blocks[current].size) {
+            // blocks after the current one are left over from a rollback and are reused when large enough
+            size_t next = blocks.empty() ? 0 : current + 1;
+            if (next == blocks.size() || blocks[next].size < bytes) {
+                size_t size = blocks.empty() ? first_block : std::min(blocks.back().size * 2, max_block);
+                size = std::max(size, bytes);
+                blocks.insert(blocks.begin() + (std::ptrdiff_t) next, {std::make_unique<char[]>(size), size});
+            }
+            current = next;
+            start = 0;
+        }
+        used = start + bytes;
+        return blocks[current].data.get() + start;
+    }
+
+    template<typename T, typename... Args>
+    T *make(Args &&... args) { return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...); }
+
+    // keeps another arena, and so every node in it, alive for as long as this one
+    void adopt(std::shared_ptr<Arena> other) { adopted.push_back(move(other)); }
+
+    Mark mark() const { return {current, used}; }
+
+    void rollback(Mark mark) {
+        current = mark.block;
+        used = mark.used;
+    }
+
+    // rolls back everything, keeping the blocks for reuse
+    void reset() { rollback({0, 0}); }
+};
+
+/*
+ * Budget - limits on the work spent on one input, for transpiling untrusted sources; a limit of 0 means none. Each
+ * stage checks its own counters against the limits, records the first one passed and then fails as fast as it can.
+ */
+struct Budget {
+    uint64_t steps = 0;   // rule and terminal attempts of the Syntaxer
+    uint64_t depth = 0;   // rule attempts in progress, or frames of the predictive parser
+    uint64_t nodes = 0;   // Ast nodes
+    uint64_t output = 0;  // bytes of generated code
+
+    const char *exceeded = nullptr;  // the first limit passed
+
+    bool over(uint64_t used, uint64_t limit, const char *name) {
+        if (limit == 0 || used <= limit) return false;
+        if (exceeded == nullptr) exceeded = name;
+        return true;
+    }
+};
+
 #define FUNC(func) &Syntaxer::func
 #define TERMINAL(token) Node::Ptr token() { return move(terminal(Lexer::token)); };
 
 #define BEGIN_RULE(name) \
 Node::Ptr name() \
 { \
-    Node::Ptr node = Node::MakePtr(); \
-    auto orig_pos = pos;
+    static const char rule = 0; \
+    constexpr string_view rule_name = #name; \
+    if (!spend(marks.size() + 1)) return nullptr; \
+    if (packrat) { \
+        auto hit = memo.find({&rule, pos}); \
+        if (hit != memo.end()) { \
+            if constexpr (collect_stats) stats.rules[rule_name].count(hit->second.node != nullptr, 0); \
+            pos = hit->second.end; \
+            return hit->second.node; \
+        } \
+    } \
+    auto orig_arena = arena->mark(); \
+    Node::Ptr node = Node::MakePtr(*arena); \
+    auto orig_pos = pos; \
+    auto outer_furthest = furthest; \
+    if constexpr (collect_stats) furthest = pos; \
+    Mark mark(marks, pos);
 
 #define END_RULE \
-    if (node == nullptr) { pos = orig_pos; } return move(node); \
+    if constexpr (collect_stats) { \
+        stats.rules[rule_name].count(node != nullptr, node == nullptr ? furthest - orig_pos : 0); \
+        furthest = std::max(outer_furthest, furthest); \
+    } \
+    if (node == nullptr) { pos = orig_pos; if (!packrat) arena->rollback(orig_arena); } \
+    if (packrat) memo[{&rule, orig_pos}] = {node, pos}; \
+    return move(node); \
 };
 
 /**
@@ -142,9 +999,56 @@ Node::Ptr name() \
  */
 class Syntaxer {
 public:
+    /*
+     * Parse tree node. Nodes live in the Syntaxer's Arena and are referenced by plain pointers; the tree stays valid
+     * for as long as that arena does.
+     */
     struct Node {
-        typedef std::unique_ptr<Node> Ptr;
-        typedef std::vector<Ptr> PtrVec;
+        typedef Node *Ptr;
+        typedef const Node *ConstPtr;
+
+        // Child list with room for four children inside the node, longer lists spill into the arena.
+        class PtrVec {
+            static constexpr uint32_t inline_capacity = 4;
+
+            Arena *arena;
+            uint32_t count = 0;
+            uint32_t capacity = inline_capacity;
+            Ptr *spill = nullptr;
+            Ptr items[inline_capacity];
+
+        public:
+            explicit PtrVec(Arena &arena) { this->arena = &arena; }
+
+            Ptr *begin() { return capacity > inline_capacity ? spill : items; }
+
+            Ptr *end() { return begin() + count; }
+
+            const Ptr *begin() const { return capacity > inline_capacity ? spill : items; }
+
+            const Ptr *end() const { return begin() + count; }
+
+            size_t size() const { return count; }
+
+            bool empty() const { return count == 0; }
+
+            Ptr &operator[](size_t i) { return begin()[i]; }
+
+            const Ptr &operator[](size_t i) const { return begin()[i]; }
+
+            Ptr &back() { return begin()[count - 1]; }
+
+            void push_back(Ptr node) {
+                if (count == capacity) {
+                    auto grown = (Ptr *) arena->allocate(sizeof(Ptr) * capacity * 2, alignof(Ptr));
+                    std::copy(begin(), end(), grown);
+                    spill = grown;
+                    capacity *= 2;
+                }
+                begin()[count++] = node;
+            }
+        };
+
         typedef enum {
             generic,
             function,
@@ -162,32 +1066,27 @@ public:
         Lexer::Token token;
 
 
-        explicit Node() {
+        explicit Node(Arena &arena) : next(arena) {
             token = Lexer::Token();
             type = generic;
         }
 
-        explicit Node(Lexer::Token token) {
+        explicit Node(Arena &arena, Lexer::Token token) : next(arena) {
             this->token = move(token);
             type = basic_value;
         }
 
         Node(const Node &) = delete;
 
-        Node(Node &&other) noexcept : next(move(other.next)), type(other.type) {}
-
-        //Node& operator=(const Node&& other) noexcept { next = move(other.next); type = other.type; }
         Node &operator=(const Node &) = delete;
 
-        ~Node() = default;
+        static Ptr MakePtr(Arena &arena) { return arena.make<Node>(arena); }
 
-        static Ptr MakePtr() { return move(std::make_unique<Node>()); }
+        static Ptr MakePtr(Arena &arena, Lexer::Token t) { return arena.make<Node>(arena, t); }
 
-        static Ptr MakePtr(Lexer::Token t) { return move(std::make_unique<Node>(t)); }
+        bool is_terminal() const { return token.type != Lexer::null; }
 
-        bool is_terminal() { return token.type != Lexer::null; }
-
-        string value() { return token.value; }
+        string_view value() { return token.value; }
 
         void append(Ptr &&node) {
             if (node == nullptr) return;
@@ -201,47 +1100,244 @@ public:
 
     typedef Syntaxer::Node::Ptr (Syntaxer::*FuncPtr)();
 
-    std::vector<Lexer::Token> tokens;
-    std::vector<Lexer::Token>::iterator pos;
+    // Records where a rule attempt started for as long as it is in progress, those tokens may be needed again.
+    struct Mark {
+        std::vector<size_t> &marks;
+
+        Mark(std::vector<size_t> &marks, size_t pos) : marks(marks) { marks.push_back(pos); }
+
+        ~Mark() { marks.pop_back(); }
+    };
+
+    /*
+     * Packrat memo - the outcome of every rule attempt keyed by (rule, start token): the node and where it ended, or
+     * a null node for failure. A rule is then evaluated at most once per position, which keeps backtracking linear.
+     */
+    struct MemoKey {
+        const void *rule;
+        size_t pos;
+
+        bool operator==(const MemoKey &other) const { return rule == other.rule && pos == other.pos; }
+    };
+
+    struct MemoHash {
+        size_t operator()(const MemoKey &key) const { return std::hash<size_t>()(key.pos * 64 + (uintptr_t) key.rule); }
+    };
+
+    struct MemoEntry {
+        Node::Ptr node;
+        size_t end;
+    };
+
+    bool packrat = false;
+    std::unordered_map<MemoKey, MemoEntry, MemoHash> memo;
+
+    /*
+     * Statistics - compiled in with SSHARP_PARSER_STATS, otherwise every use is discarded by if constexpr. A failed
+     * attempt that had consumed tokens is a backtrack; the tokens it consumed, its sub-rules' included, are counted
+     * as discarded.
+     */
+    static constexpr bool collect_stats = SSHARP_PARSER_STATS;
+
+    struct Counters {
+        uint64_t calls = 0;
+        uint64_t successes = 0;
+        uint64_t failures = 0;
+        uint64_t backtracks = 0;
+        uint64_t discarded = 0;
+
+        void count(bool success, size_t discarded_tokens) {
+            calls++;
+            if (success) successes++;
+            else failures++;
+            if (discarded_tokens > 0) {
+                backtracks++;
+                discarded += discarded_tokens;
+            }
+        }
+
+        void merge(const Counters &other) {
+            calls += other.calls;
+            successes += other.successes;
+            failures += other.failures;
+            backtracks += other.backtracks;
+            discarded += other.discarded;
+        }
+    };
+
+    struct Stats {
+        static constexpr const char *terminal_names[] = {
+                "null", "lparen", "rparen", "lbrace", "rbrace", "times", "slash", "plus", "minus", "mod", "andsym",
+                "orsym", "eql", "neq", "lss", "gtr", "semicolon", "comma", "ifsym", "negation", "ident", "number"};
+
+        std::unordered_map<string_view, Counters> rules;
+        Counters terminals[Lexer::number + 1];
+
+        void merge(const Stats &other) {
+            for (auto &rule : other.rules) rules[rule.first].merge(rule.second);
+            for (int t = 0; t <= Lexer::number; ++t) terminals[t].merge(other.terminals[t]);
+        }
+
+        static void print(std::ostream &os, string_view name, const Counters &c) {
+            os << "\"" << name << "\": {\"calls\": " << c.calls << ", \"successes\": " << c.successes
+               << ", \"failures\": " << c.failures << ", \"backtracks\": " << c.backtracks
+               << ", \"discarded_tokens\": " << c.discarded << "}";
+        }
+
+        void print(std::ostream &os) const {
+            std::vector<std::pair<string_view, Counters>> sorted(rules.begin(), rules.end());
+            std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+            os << "{\"rules\": {";
+            for (size_t i = 0; i < sorted.size(); ++i) {
+                os << (i ? ", " : "");
+                print(os, sorted[i].first, sorted[i].second);
+            }
+            os << "}, \"terminals\": {";
+            bool first = true;
+            for (int t = 0; t <= Lexer::number; ++t) {
+                if (terminals[t].calls == 0) continue;
+                os << (first ? "" : ", ");
+                print(os, terminal_names[t], terminals[t]);
+                first = false;
+            }
+            os << "}}" << std::endl;
+        }
+    };
+
+    Stats stats;
+    size_t furthest = 0;  // furthest token consumed by the rule attempts in progress
+
+    // owns every node of the trees built by this Syntaxer; rollbacks are skipped under packrat since memo entries
+    // may point past the mark
+    std::shared_ptr<Arena> arena = std::make_shared<Arena>();
+
+    // under packrat, the arena a top-level function is parsed in before its tree is copied out into arena
+    std::shared_ptr<Arena> scratch;
+
+    TokenStream tokens;
+    size_t pos;
+    std::vector<size_t> marks;
+    TokenQueue *queue = nullptr;
+    Lexer *lexer = nullptr;
+
+    static constexpr size_t stream_batch = 4096;
+
+    Budget *budget = nullptr;
+    uint64_t steps = 0;
+
+    // Parallel batches spend from one counter shared by all of them. Each adds its steps every step_flush steps, so
+    // the limit holds for the whole input whatever --jobs is, and a batch stops soon after any of them passes it.
+    static constexpr uint64_t step_flush = 1024;
+    std::atomic<uint64_t> *shared_steps = nullptr;
+    uint64_t flushed_steps = 0;
+    uint64_t total_steps = 0;  // by all batches, as of the last flush
+
+    void flush_steps() {
+        total_steps = shared_steps->fetch_add(steps - flushed_steps, std::memory_order_relaxed) + steps - flushed_steps;
+        flushed_steps = steps;
+    }
+
+    // counts one step taken at the given depth; false once the budget is used up, which fails every attempt after
+    bool spend(size_t depth) {
+        steps++;
+        if (budget == nullptr) return true;
+        if (shared_steps != nullptr && steps - flushed_steps == step_flush) flush_steps();
+        return budget->exceeded == nullptr &&
+               !budget->over(shared_steps != nullptr ? total_steps : steps, budget->steps, "parser steps") &&
+               !budget->over(depth, budget->depth, "nesting depth");
+    }
+
+    explicit Syntaxer(TokenStream &&tokens) { this->tokens = move(tokens); }
+
+    // pipelined mode - tokens are pulled from the queue as the Lexer produces them
+    explicit Syntaxer(TokenQueue &queue) { this->queue = &queue; }
+
+    // streaming mode - tokens are lexed on demand, and released once no rule attempt in progress can rewind to them
+    Syntaxer(Lexer &lexer, const char *base) : tokens(base) { this->lexer = &lexer; }
+
+    /*
+     * Every finished top-level function goes to sink when one is set, instead of becoming a child of the program
+     * node. The function's nodes are then rolled back, so the arena only ever holds the function being parsed; a
+     * sink that fails fails the parse.
+     */
+    std::function<bool(Node::ConstPtr)> sink;
 
-    explicit Syntaxer(std::vector<Lexer::Token>&& tokens) { this->tokens = move(tokens); }
+    bool keep(Node::Ptr program, Node::Ptr function, Arena::Mark before) {
+        if (!sink) {
+            program->next.push_back(function);
+            return true;
+        }
+        if (!sink(function)) return false;
+        arena->rollback(before);
+        return true;
+    }
+
+    bool fill() {
+        if (queue == nullptr && lexer == nullptr) return false;
+
+        // the program rule itself is never retried, so only attempts below it hold tokens
+        tokens.release(marks.size() > 1 ? marks[1] : pos);
+
+        if (lexer != nullptr) {
+            size_t before = tokens.size();
+            if (!lexer->analyse(tokens, stream_batch)) lexer = nullptr;
+            return tokens.size() > before;
+        }
+
+        TokenQueue::Batch batch;
+        if (!queue->pop(batch)) {
+            queue = nullptr;
+            return false;
+        }
+        tokens.append(batch);
+        return true;
+    }
 
     Node::Ptr terminal(Lexer::Type type) {
-        Node::Ptr node = Node::MakePtr();
+        Node::Ptr node = nullptr;
+        if (!spend(marks.size())) return nullptr;
 
-        if (eof() || pos->type != type) { node = nullptr; }
-        else {
-            node = Node::MakePtr(*pos);
+        if (!eof() && tokens.type(pos) == type) {
+            node = Node::MakePtr(*arena, tokens.token(pos));
             pos++;
+            if constexpr (collect_stats) furthest = std::max(furthest, pos);
         }
+        if constexpr (collect_stats) stats.terminals[type].count(node != nullptr, 0);
 
         return move(node);
     }
 
-    Node::Ptr conjunction(std::vector<FuncPtr> funcs) {
-        Node::Ptr node = Node::MakePtr();
+    // Combinators take their parts as template arguments, so every use is expanded at compile time into direct
+    // calls; the folds over && and || stop at the first part that fails or succeeds.
+    template<FuncPtr... funcs>
+    Node::Ptr conjunction() {
+        auto orig_arena = arena->mark();
+        Node::Ptr node = Node::MakePtr(*arena);
         auto orig_pos = pos;
+        Mark mark(marks, pos);
 
-        for (auto &func : funcs) {
-            if (Node::Ptr child = (this->*func)())
-                node->next.push_back(move(child));
-            else {
-                pos = orig_pos;
-                node = nullptr;
-                break;
-            }
+        auto part = [&](FuncPtr func) {
+            Node::Ptr child = (this->*func)();
+            if (child == nullptr) return false;
+            node->next.push_back(child);
+            return true;
+        };
+
+        if (!(part(funcs) && ...)) {
+            pos = orig_pos;
+            node = nullptr;
+            if (!packrat) arena->rollback(orig_arena);
         }
 
         return move(node);
     };
 
-    Node::Ptr disjunction(std::vector<FuncPtr> funcs) {
+    template<FuncPtr... funcs>
+    Node::Ptr disjunction() {
         Node::Ptr node = nullptr;
-        auto orig_pos = pos;
 
-        for (auto &func : funcs)
-            if (node = (this->*func)())
-                break;
+        (((node = (this->*funcs)()) != nullptr) || ...);
 
         return move(node);
     };
@@ -305,27 +1401,27 @@ public:
     END_RULE
 
     BEGIN_RULE(function_call)
-        node = conjunction({FUNC(ident), FUNC(lparen), FUNC(params_call), FUNC(rparen)});
+        node = conjunction<FUNC(ident), FUNC(lparen), FUNC(params_call), FUNC(rparen)>();
         if (node != nullptr) node->type = Node::function_call;
     END_RULE
 
     BEGIN_RULE(binary_operator)
-        node = disjunction(
-                {FUNC(times), FUNC(slash), FUNC(plus), FUNC(minus), FUNC(mod), FUNC(eql), FUNC(neq), FUNC(lss),
-                 FUNC(gtr)});
+        node = disjunction<
+                FUNC(times), FUNC(slash), FUNC(plus), FUNC(minus), FUNC(mod), FUNC(eql), FUNC(neq), FUNC(lss),
+                FUNC(gtr)>();
         if (node != nullptr) node->type = Node::binary_operator;
     END_RULE
 
     BEGIN_RULE(logical_operator)
-        node = disjunction({FUNC(andsym), FUNC(orsym)});
+        node = disjunction<FUNC(andsym), FUNC(orsym)>();
     END_RULE
 
     BEGIN_RULE(logical_operation)
-        node = conjunction({FUNC(logical_operator), FUNC(expression)});
+        node = conjunction<FUNC(logical_operator), FUNC(expression)>();
     END_RULE
 
     BEGIN_RULE(binary_operation)
-        node = conjunction({FUNC(binary_operator), FUNC(expression)});
+        node = conjunction<FUNC(binary_operator), FUNC(expression)>();
     END_RULE
 
     BEGIN_RULE(condition)
@@ -335,427 +1431,1618 @@ public:
             node->next.push_back(move(child));
         else node = nullptr;
 
-        if (node != nullptr)
-            if (auto op = move(logical_operation()))
-                node->next.push_back(move(op));
-        if (node != nullptr) node->type = Node::condition;
-    END_RULE
+        if (node != nullptr)
+            if (auto op = move(logical_operation()))
+                node->next.push_back(move(op));
+        if (node != nullptr) node->type = Node::condition;
+    END_RULE
+
+    BEGIN_RULE(condition_expression)
+        node = conjunction<FUNC(ifsym), FUNC(lparen), FUNC(condition), FUNC(rparen), FUNC(body), FUNC(body)>();
+        if (node != nullptr) node->type = Node::conditional_expression;
+    END_RULE
+
+    BEGIN_RULE(group)
+        node = conjunction<FUNC(lparen), FUNC(expression), FUNC(rparen)>();
+        if (node != nullptr) node->type = Node::group;
+    END_RULE
+
+    BEGIN_RULE(expression)
+        if (auto child =
+                disjunction<FUNC(body), FUNC(group), FUNC(function_call), FUNC(condition_expression), FUNC(number),
+                            FUNC(ident)>())
+            node->next.push_back(move(child));
+        if (!node->next.empty()) if (auto op = move(binary_operation())) node->next.push_back(move(op));
+        if (node->next.empty()) node = nullptr;
+    END_RULE
+
+    BEGIN_RULE(params)
+        while (true) {
+            if (Node::Ptr child = terminal(Lexer::ident))
+                node->next.push_back(move(child));
+            else break;
+        }
+    END_RULE
+
+    BEGIN_RULE(body_inner)  // TODO - use same format as params_call
+        while (true) {
+            if (Node::Ptr child = expression())
+                node->next.push_back(move(child));
+            else {
+                node = nullptr;
+                break;
+            }
+            if (Node::Ptr child = semicolon())
+                node->next.push_back(move(child));
+            else break;
+        }
+        if (node != nullptr && node->next.empty()) node = nullptr;
+    END_RULE
+
+    BEGIN_RULE(body)
+        node = conjunction<FUNC(lbrace), FUNC(body_inner), FUNC(rbrace)>();
+        if (node != nullptr) node->type = Node::body;
+    END_RULE
+
+    BEGIN_RULE(function)
+        node = conjunction<FUNC(ident), FUNC(params), FUNC(body)>();
+        if (node != nullptr) node->type = Node::function;
+    END_RULE
+
+
+    // copies tree into arena, walking it with an explicit stack
+    Node::Ptr copy_tree(Node::ConstPtr tree) {
+        auto clone = [&](Node::ConstPtr node) {
+            Node::Ptr copy = Node::MakePtr(*arena, node->token);
+            copy->type = node->type;
+            return copy;
+        };
+
+        Node::Ptr root = clone(tree);
+        std::vector<std::pair<Node::ConstPtr, Node::Ptr>> stack{{tree, root}};
+        while (!stack.empty()) {
+            auto p = stack.back();
+            stack.pop_back();
+            for (auto child : p.first->next) {
+                Node::Ptr copy = clone(child);
+                p.second->next.push_back(copy);
+                stack.emplace_back(child, copy);
+            }
+        }
+        return root;
+    }
+
+    /*
+     * One top-level function. Nothing rewinds into a finished function, so the memo is dropped after it. Under
+     * packrat failed attempts cannot be rolled back while the memo may still point at them, so the function is parsed
+     * in the scratch arena, only the accepted tree is copied into arena, and the scratch arena is then reset whole.
+     */
+    Node::Ptr top_function() {
+        if (!packrat) return function();
+
+        if (scratch == nullptr) scratch = std::make_shared<Arena>();
+        std::swap(arena, scratch);
+        Node::Ptr parsed = function();
+        memo.clear();
+        std::swap(arena, scratch);
+
+        if (parsed != nullptr) parsed = copy_tree(parsed);
+        scratch->reset();
+        return parsed;
+    }
+
+    BEGIN_RULE(program)
+        size_t count = 0;
+        while (!eof()) {
+            auto before = arena->mark();
+            if (Node::Ptr child = top_function()) {
+                if (!keep(node, child, before)) {
+                    node = nullptr;
+                    break;
+                }
+                count++;
+            } else {
+                node = nullptr;
+                break;
+            }
+        }
+
+        if (node != nullptr && count == 0) node = nullptr;
+    END_RULE
+
+    /*
+     * Predictive parser - a second implementation of the grammar above. Every alternative is chosen from the current
+     * token, plus one token of lookahead to tell a call from a variable, so it never rewinds. A failure anywhere is
+     * final, which matches the rules above: no caller can recover from a sub-expression that fails. It builds the
+     * same trees, including the right-nested binary_operation chains.
+     *
+     * Pending rules are kept as frames on a heap stack rather than as native calls, so neither nesting depth nor the
+     * length of an operator chain is bounded by the thread's stack.
+     */
+    static bool starts_expression(Lexer::Type type) {
+        return type == Lexer::lbrace || type == Lexer::lparen || type == Lexer::ident || type == Lexer::ifsym ||
+               type == Lexer::number;
+    }
+
+    static bool is_binary_operator(Lexer::Type type) {
+        return type == Lexer::times || type == Lexer::slash || type == Lexer::plus || type == Lexer::minus ||
+               type == Lexer::mod || type == Lexer::eql || type == Lexer::neq || type == Lexer::lss ||
+               type == Lexer::gtr;
+    }
+
+    bool lookahead(size_t ahead, Lexer::Type type) {
+        while (pos + ahead >= tokens.size())
+            if (!fill()) return false;
+        return tokens.type(pos + ahead) == type;
+    }
+
+    enum class Goal : uint8_t {
+        function, body, expression, operand, group, function_call, condition_expression, condition
+    };
+
+    // a rule in progress: step says where to resume once the sub-rule it is waiting for has produced a result
+    struct Frame {
+        Goal goal;
+        uint8_t step;
+        Node::Ptr node;
+        Node::Ptr aux;  // body_inner, params_call, the logical operation, or the innermost link of an operator chain
+    };
+
+    Node::Ptr predict_function(std::vector<Frame> &stack) {
+        Node::Ptr result = nullptr;
+
+        auto expect = [](Node::Ptr parent, Node::Ptr child) {
+            if (child == nullptr) return false;
+            parent->next.push_back(child);
+            return true;
+        };
+
+        stack.push_back({Goal::function, 0, nullptr, nullptr});
+        while (!stack.empty()) {
+            // stack may grow below, so frame is only used before the next push
+            Frame &frame = stack.back();
+
+            // waits for `goal`, resuming this frame at `step`
+            auto call = [&](uint8_t step, Goal goal) {
+                frame.step = step;
+                stack.push_back({goal, 0, nullptr, nullptr});
+            };
+
+            auto ret = [&](Node::Ptr node) {
+                stack.pop_back();
+                result = node;
+            };
+
+            if (frame.step > 0 && result == nullptr) return nullptr;
+            if (!spend(stack.size())) return nullptr;
+
+            switch (frame.goal) {
+                case Goal::function:
+                    if (frame.step == 0) {
+                        frame.node = Node::MakePtr(*arena);
+                        frame.node->type = Node::function;
+                        if (!expect(frame.node, ident())) return nullptr;
+                        Node::Ptr idents = Node::MakePtr(*arena);
+                        while (Node::Ptr child = ident()) idents->next.push_back(move(child));
+                        frame.node->next.push_back(move(idents));
+                        call(1, Goal::body);
+                    } else {
+                        frame.node->next.push_back(result);
+                        ret(frame.node);
+                    }
+                    break;
+
+                case Goal::body:
+                    if (frame.step == 0) {
+                        frame.node = Node::MakePtr(*arena);
+                        frame.node->type = Node::body;
+                        if (!expect(frame.node, lbrace())) return nullptr;
+                        frame.aux = Node::MakePtr(*arena);
+                        call(1, Goal::expression);
+                    } else {
+                        frame.aux->next.push_back(result);
+                        if (Node::Ptr child = semicolon()) {
+                            frame.aux->next.push_back(move(child));
+                            call(1, Goal::expression);
+                            break;
+                        }
+                        frame.node->next.push_back(frame.aux);
+                        if (!expect(frame.node, rbrace())) return nullptr;
+                        ret(frame.node);
+                    }
+                    break;
+
+                case Goal::expression:
+                    // operand (operator operand)* - S# gives all binary operators one precedence level and leaves
+                    // precedence to the C++ compiler; each operator links a new expression node to the right
+                    if (frame.step == 0) {
+                        frame.node = frame.aux = Node::MakePtr(*arena);
+                        call(1, Goal::operand);
+                    } else {
+                        frame.aux->next.push_back(result);
+                        if (eof() || !is_binary_operator(tokens.type(pos))) {
+                            ret(frame.node);
+                            break;
+                        }
+                        Node::Ptr op = terminal(tokens.type(pos));
+                        if (op == nullptr) return nullptr;
+                        op->type = Node::binary_operator;
+                        Node::Ptr operation = Node::MakePtr(*arena);
+                        operation->next.push_back(move(op));
+                        Node::Ptr rest = Node::MakePtr(*arena);
+                        operation->next.push_back(rest);
+                        frame.aux->next.push_back(move(operation));
+                        frame.aux = rest;
+                        call(1, Goal::operand);
+                    }
+                    break;
+
+                case Goal::operand:
+                    // replaced in place by the rule the current token selects
+                    if (eof()) return nullptr;
+                    switch (tokens.type(pos)) {
+                        case Lexer::lbrace:
+                            frame.goal = Goal::body;
+                            break;
+                        case Lexer::lparen:
+                            frame.goal = Goal::group;
+                            break;
+                        case Lexer::ident:
+                            if (lookahead(1, Lexer::lparen)) frame.goal = Goal::function_call;
+                            else ret(ident());
+                            break;
+                        case Lexer::ifsym:
+                            frame.goal = Goal::condition_expression;
+                            break;
+                        case Lexer::number:
+                            ret(number());
+                            break;
+                        default:
+                            return nullptr;
+                    }
+                    break;
+
+                case Goal::group:
+                    if (frame.step == 0) {
+                        frame.node = Node::MakePtr(*arena);
+                        frame.node->type = Node::group;
+                        if (!expect(frame.node, lparen())) return nullptr;
+                        call(1, Goal::expression);
+                    } else {
+                        frame.node->next.push_back(result);
+                        if (!expect(frame.node, rparen())) return nullptr;
+                        ret(frame.node);
+                    }
+                    break;
+
+                case Goal::function_call:
+                    if (frame.step == 0) {
+                        frame.node = Node::MakePtr(*arena);
+                        frame.node->type = Node::function_call;
+                        if (!expect(frame.node, ident()) || !expect(frame.node, lparen())) return nullptr;
+                        frame.aux = Node::MakePtr(*arena);
+                        if (!eof() && starts_expression(tokens.type(pos))) {
+                            call(1, Goal::expression);
+                            break;
+                        }
+                    } else frame.aux->next.push_back(result);
+
+                    if (Node::Ptr child = comma()) {
+                        frame.aux->next.push_back(move(child));
+                        call(1, Goal::expression);
+                        break;
+                    }
+                    frame.node->next.push_back(frame.aux);
+                    if (!expect(frame.node, rparen())) return nullptr;
+                    ret(frame.node);
+                    break;
+
+                case Goal::condition_expression:
+                    switch (frame.step) {
+                        case 0:
+                            frame.node = Node::MakePtr(*arena);
+                            frame.node->type = Node::conditional_expression;
+                            if (!expect(frame.node, ifsym()) || !expect(frame.node, lparen())) return nullptr;
+                            call(1, Goal::condition);
+                            break;
+                        case 1:
+                            frame.node->next.push_back(result);
+                            if (!expect(frame.node, rparen())) return nullptr;
+                            call(2, Goal::body);
+                            break;
+                        case 2:
+                            frame.node->next.push_back(result);
+                            call(3, Goal::body);
+                            break;
+                        default:
+                            frame.node->next.push_back(result);
+                            ret(frame.node);
+                    }
+                    break;
+
+                case Goal::condition:
+                    if (frame.step == 0) {
+                        frame.node = Node::MakePtr(*arena);
+                        frame.node->type = Node::condition;
+                        if (Node::Ptr child = negation()) frame.node->next.push_back(move(child));
+                        call(1, Goal::expression);
+                    } else if (frame.step == 1) {
+                        frame.node->next.push_back(result);
+                        if (Node::Ptr op = disjunction<FUNC(andsym), FUNC(orsym)>()) {
+                            frame.aux = Node::MakePtr(*arena);
+                            frame.aux->next.push_back(move(op));
+                            call(2, Goal::expression);
+                        } else ret(frame.node);
+                    } else {
+                        frame.aux->next.push_back(result);
+                        frame.node->next.push_back(frame.aux);
+                        ret(frame.node);
+                    }
+                    break;
+            }
+        }
+        return result;
+    }
+
+    Node::Ptr predict_program() {
+        Node::Ptr node = Node::MakePtr(*arena);
+        std::vector<Frame> stack;
+        size_t count = 0;
+        while (!eof()) {
+            auto before = arena->mark();
+            Node::Ptr child = predict_function(stack);
+            if (child == nullptr || !keep(node, child, before)) return nullptr;
+            count++;
+        }
+        return count == 0 ? nullptr : node;
+    }
+
+    /*
+     * Parallel mode - a top-level function ends at the closing brace that brings the nesting depth back to zero, so
+     * a scan over the token types finds function boundaries without parsing. The tokens are cut there into batches
+     * of whole functions, every batch is parsed by its own Syntaxer and arena, and the functions are attached to the
+     * program in source order. When the input is not a valid program some batch fails, as the serial parse would.
+     */
+    static constexpr size_t min_batch = 1 << 14;  // tokens
+
+    // token indices just past the closing braces that end top-level functions, at least min_tokens apart and framed
+    // by the first and last index
+    std::vector<size_t> function_cuts(size_t min_tokens) const {
+        std::vector<size_t> cuts{tokens.first};
+        size_t depth = 0;
+        for (size_t i = tokens.first; i < tokens.size(); ++i) {
+            if (tokens.type(i) == Lexer::lbrace) depth++;
+            else if (tokens.type(i) == Lexer::rbrace && depth > 0 && --depth == 0 && i + 1 - cuts.back() >= min_tokens)
+                cuts.push_back(i + 1);
+        }
+        if (cuts.back() != tokens.size()) cuts.push_back(tokens.size());
+        return cuts;
+    }
+
+    Node::Ptr analyse_parallel() {
+        std::vector<size_t> cuts = function_cuts(std::max(min_batch, (tokens.size() - tokens.first) / (jobs * 16)));
+
+        std::vector<Node::Ptr> parts(cuts.size() - 1);
+        std::vector<std::shared_ptr<Arena>> arenas(parts.size());
+        std::vector<Stats> part_stats(collect_stats ? parts.size() : 0);
+        // every batch records the limit it passed in its own copy of the budget, and all spend steps from spent
+        std::vector<Budget> part_budgets(budget != nullptr ? parts.size() : 0, budget != nullptr ? *budget : Budget());
+        std::atomic<uint64_t> spent{steps};
+        parallel_for(parts.size(), jobs, [&](size_t k) {
+            Syntaxer part(tokens.slice(cuts[k], cuts[k + 1]));
+            part.packrat = packrat;
+            part.predictive = predictive;
+            if (budget != nullptr) {
+                part.budget = &part_budgets[k];
+                part.shared_steps = &spent;
+            }
+            parts[k] = part.analyse();
+            if (budget != nullptr) {
+                part.flush_steps();
+                part.budget->over(part.total_steps, budget->steps, "parser steps");
+            }
+            arenas[k] = part.arena;
+            if constexpr (collect_stats) part_stats[k] = move(part.stats);
+        });
+        steps = spent;
+        for (auto &s : part_stats) stats.merge(s);
+        for (auto &b : part_budgets)
+            if (budget->exceeded == nullptr) budget->exceeded = b.exceeded;
+
+        Node::Ptr node = Node::MakePtr(*arena);
+        for (size_t k = 0; k < parts.size(); ++k) {
+            if (parts[k] == nullptr) return nullptr;
+            for (auto child : parts[k]->next) node->next.push_back(child);
+            arena->adopt(move(arenas[k]));
+        }
+        return node->next.empty() ? nullptr : node;
+    }
+
+    /*
+     * Incremental mode - for repeated runs over a file being edited. The trees of top-level functions are kept
+     * between runs, keyed by a hash of each function's tokens, and only functions whose tokens changed are parsed
+     * again. An entry keeps the arena its nodes live in alive, but not the source text: the token views of a node are
+     * cleared when it enters the cache, so cached tokens carry only their type, symbol and literal. A successful run
+     * leaves exactly its own functions in the cache, a failed one leaves the cache as it was. Identifiers are compared
+     * by symbol id, so all runs must share one Interner.
+     */
+    struct FunctionCache {
+        struct Entry {
+            Node::Ptr node;
+            std::shared_ptr<Arena> arena;
+        };
+
+        std::unordered_map<uint64_t, Entry> functions;
+        size_t reparsed = 0;  // by the last run
+    };
+
+    FunctionCache *cache = nullptr;
+
+    uint64_t hash_tokens(size_t from, size_t to) const {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (size_t i = from; i < to; ++i) {
+            Lexer::Token token = tokens.token(i);
+            uint64_t data = token.type == Lexer::ident ? token.symbol : token.literal;
+            hash = (hash ^ token.type) * 0x100000001b3;
+            hash = (hash ^ data) * 0x100000001b3;
+        }
+        return hash;
+    }
+
+    // whether the leaves of tree, left to right, are the tokens [from, to) - guards against hash collisions
+    bool same_tokens(Node::Ptr tree, size_t from, size_t to) const {
+        std::vector<Node::Ptr> stack{tree};
+        size_t i = from;
+        while (!stack.empty()) {
+            Node::Ptr node = stack.back();
+            stack.pop_back();
+            if (node->is_terminal()) {
+                if (i == to) return false;
+                Lexer::Token token = tokens.token(i++);
+                if (node->token.type != token.type || node->token.symbol != token.symbol ||
+                    node->token.literal != token.literal)
+                    return false;
+            }
+            for (size_t k = node->next.size(); k-- > 0;) stack.push_back(node->next[k]);
+        }
+        return i == to;
+    }
+
+    // clears the token views of a tree, which point into a source that is freed after this run
+    static void forget_text(Node::Ptr tree) {
+        std::vector<Node::Ptr> stack{tree};
+        while (!stack.empty()) {
+            Node::Ptr node = stack.back();
+            stack.pop_back();
+            node->token.value = {};
+            for (auto child : node->next) stack.push_back(child);
+        }
+    }
+
+    Node::Ptr analyse_incremental() {
+        std::unordered_map<uint64_t, FunctionCache::Entry> functions;
+        std::vector<Frame> stack;
+        std::vector<size_t> cuts = function_cuts(1);
+        size_t reparsed = 0;
+
+        Node::Ptr node = Node::MakePtr(*arena);
+        for (size_t k = 0; k + 1 < cuts.size(); ++k) {
+            uint64_t hash = hash_tokens(cuts[k], cuts[k + 1]);
+            auto hit = cache->functions.find(hash);
+            if (hit != cache->functions.end() && same_tokens(hit->second.node, cuts[k], cuts[k + 1])) {
+                node->next.push_back(hit->second.node);
+                functions.emplace(hash, hit->second);
+                continue;
+            }
+
+            pos = cuts[k];
+            Node::Ptr parsed = predictive ? predict_function(stack) : top_function();
+            if (parsed == nullptr || pos != cuts[k + 1]) return nullptr;
+            node->next.push_back(parsed);
+            forget_text(parsed);
+            functions[hash] = {parsed, arena};
+            reparsed++;
+        }
+        if (node->next.empty()) return nullptr;
+
+        cache->functions = move(functions);
+        cache->reparsed = reparsed;
+        return node;
+    }
+
+    bool predictive = false;
+    unsigned jobs = 1;  // more than one requires the whole token stream up front
+
+    Node::Ptr analyse() {
+        if (cache != nullptr) return analyse_incremental();
+        if (jobs > 1) return analyse_parallel();
+
+        pos = tokens.first;
+        Node::Ptr tree = predictive ? predict_program() : program();
+        memo.clear();
+        return tree;
+    };
+
+    bool eof() {
+        while (pos == tokens.size())
+            if (!fill()) return true;
+        return false;
+    };
+
+    // structural equality of two parse trees, walked with an explicit stack; tokens are compared by type, symbol and
+    // literal, which unlike their views stay valid in cached trees
+    static bool same_tree(const Node *a, const Node *b) {
+        std::vector<std::pair<const Node *, const Node *>> stack = {{a, b}};
+        while (!stack.empty()) {
+            auto p = stack.back();
+            stack.pop_back();
+            if (p.first == nullptr || p.second == nullptr) {
+                if (p.first != p.second) return false;
+                continue;
+            }
+            if (p.first->type != p.second->type || p.first->token.type != p.second->token.type ||
+                p.first->token.symbol != p.second->token.symbol || p.first->token.literal != p.second->token.literal ||
+                p.first->next.size() != p.second->next.size())
+                return false;
+            for (size_t i = 0; i < p.first->next.size(); ++i)
+                stack.emplace_back(p.first->next[i], p.second->next[i]);
+        }
+        return true;
+    }
+};
+
+/*
+ * Ast - typed abstract syntax tree, lowered from a complete parse tree. Punctuation is dropped, and every node has a
+ * kind whose fields are read through the accessors below instead of child positions. Nodes are stored flat and refer
+ * to each other by index; parameter, argument and expression lists live in a shared pool as a count followed by the
+ * entries.
+ *
+ * Nodes and lists are hash-consed while lowering: each node carries a structural hash computed from its children's,
+ * and a subtree identical to one already stored is not added again but shared. Two subtrees are therefore equal
+ * exactly when their ids are, and a repeated subexpression is a node with several parents.
+ */
+class Ast {
+public:
+    typedef uint32_t Id;
+
+    typedef enum : uint8_t {
+        function, call, conditional, binary, seq, group, var, lit
+    } Kind;
+
+    // a list from the pool, of node ids or symbols
+    struct List {
+        const uint32_t *first;
+        size_t count;
+
+        const uint32_t *begin() const { return first; }
+
+        const uint32_t *end() const { return first + count; }
+
+        size_t size() const { return count; }
+
+        uint32_t operator[](size_t i) const { return first[i]; }
+    };
+
+private:
+    struct Node {
+        Kind kind;
+        uint8_t op;  // negation for a conditional whose condition is negated
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+    };
+
+    // what the fields a, b and c of each kind hold
+    typedef enum : uint8_t {
+        scalar, child, child_list, scalar_list
+    } Field;
+
+    static constexpr Field layout[][3] = {
+            {scalar,     scalar_list, child},   // function: name, params, body
+            {scalar,     child_list,  scalar},  // call: callee, args
+            {child,      child,       child},   // conditional: condition, then, else
+            {child_list, scalar_list, scalar},  // binary: operands, operators
+            {child_list, scalar,      scalar},  // seq: items
+            {child,      scalar,      scalar},  // group: inner
+            {scalar,     scalar,      scalar},  // var: symbol
+            {scalar,     scalar,      scalar},  // lit: value high, value low
+    };
 
-    BEGIN_RULE(condition_expression)
-        node = conjunction({FUNC(ifsym), FUNC(lparen), FUNC(condition), FUNC(rparen), FUNC(body), FUNC(body)});
-        if (node != nullptr) node->type = Node::conditional_expression;
-    END_RULE
+    std::vector<Node> nodes;
+    std::vector<uint64_t> hashes;  // by node
+    std::vector<uint32_t> lists;
+    std::vector<Id> functions;
 
-    BEGIN_RULE(group)
-        node = conjunction({FUNC(lparen), FUNC(expression), FUNC(rparen)});
-        if (node != nullptr) node->type = Node::group;
-    END_RULE
+    // open-addressing table from structural hash to node id or list offset, for hash-consing while lowering
+    struct Index {
+        struct Slot {
+            uint64_t hash;
+            uint32_t at;
+        };
 
-    BEGIN_RULE(expression)
-        if (auto child =
-                disjunction({FUNC(body), FUNC(group), FUNC(function_call), FUNC(condition_expression), FUNC(number),
-                             FUNC(ident)}))
-            node->next.push_back(move(child));
-        if (!node->next.empty()) if (auto op = move(binary_operation())) node->next.push_back(move(op));
-        if (node->next.empty()) node = nullptr;
-    END_RULE
+        static constexpr uint32_t empty = ~0u;
 
-    BEGIN_RULE(params)
-        while (true) {
-            if (Node::Ptr child = terminal(Lexer::ident))
-                node->next.push_back(move(child));
-            else break;
+        std::vector<Slot> slots;
+        size_t used = 0;
+
+        // the entry with this hash for which same(at) holds, or empty
+        template<typename F>
+        uint32_t find(uint64_t hash, F &&same) const {
+            if (slots.empty()) return empty;
+            for (size_t i = hash & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1)) {
+                if (slots[i].at == empty) return empty;
+                if (slots[i].hash == hash && same(slots[i].at)) return slots[i].at;
+            }
         }
-    END_RULE
 
-    BEGIN_RULE(body_inner)  // TODO - use same format as params_call
-        while (true) {
-            if (Node::Ptr child = expression())
-                node->next.push_back(move(child));
-            else {
-                node = nullptr;
-                break;
+        void insert(uint64_t hash, uint32_t at) {
+            if (2 * (used + 1) > slots.size()) {
+                std::vector<Slot> old(std::max<size_t>(1024, 2 * slots.size()), {0, empty});
+                old.swap(slots);
+                for (auto &slot : old)
+                    if (slot.at != empty) place(slot);
             }
-            if (Node::Ptr child = semicolon())
-                node->next.push_back(move(child));
-            else break;
+            place({hash, at});
+            used++;
         }
-        if (node != nullptr && node->next.empty()) node = nullptr;
-    END_RULE
 
-    BEGIN_RULE(body)
-        node = conjunction({FUNC(lbrace), FUNC(body_inner), FUNC(rbrace)});
-        if (node != nullptr) node->type = Node::body;
-    END_RULE
+        void place(Slot slot) {
+            size_t i = slot.hash & (slots.size() - 1);
+            while (slots[i].at != empty) i = (i + 1) & (slots.size() - 1);
+            slots[i] = slot;
+        }
+    };
 
-    BEGIN_RULE(function)
-        node = conjunction({FUNC(ident), FUNC(params), FUNC(body)});
-        if (node != nullptr) node->type = Node::function;
-    END_RULE
+    Index node_index;
+    Index list_index;
+
+    // what the accessors read: the vectors above, or the sections of a mapped cache file
+    const Node *node_view = nullptr;
+    const uint64_t *hash_view = nullptr;
+    const uint32_t *list_view = nullptr;
+    const Id *function_view = nullptr;
+    size_t node_count = 0;
+    size_t list_count = 0;
+    size_t function_count = 0;
+
+    static uint64_t mix(uint64_t hash, uint64_t value) {
+        hash = (hash ^ value) * 0x9e3779b97f4a7c15;
+        return hash ^ hash >> 32;
+    }
 
+    uint64_t list_hash(const uint32_t *first, size_t count, bool of_nodes) const {
+        uint64_t hash = count;
+        for (size_t i = 0; i < count; ++i) hash = mix(hash, of_nodes ? hashes[first[i]] : first[i]);
+        return hash;
+    }
 
-    BEGIN_RULE(program)
-        while (!eof()) {
-            if (Node::Ptr child = function())
-                node->next.push_back(move(child));
-            else {
-                node = nullptr;
-                break;
-            }
+    uint64_t field_hash(Field field, uint32_t v) const {
+        switch (field) {
+            case child: return hashes[v];
+            case child_list: return list_hash(lists.data() + v + 1, lists[v], true);
+            case scalar_list: return list_hash(lists.data() + v + 1, lists[v], false);
+            default: return v;
         }
+    }
 
-        if (node != nullptr && node->next.empty()) node = nullptr;
-    END_RULE
+    Id add(Kind kind, uint8_t op, uint32_t a, uint32_t b = 0, uint32_t c = 0) {
+        const Field *fields = layout[kind];
+        uint64_t hash = mix(mix(kind, op), field_hash(fields[0], a));
+        hash = mix(mix(hash, field_hash(fields[1], b)), field_hash(fields[2], c));
+
+        // children are shared already, so equal fields mean equal subtrees
+        Id id = node_index.find(hash, [&](Id other) {
+            const Node &n = nodes[other];
+            return n.kind == kind && n.op == op && n.a == a && n.b == b && n.c == c;
+        });
+        if (id != Index::empty) return id;
+
+        id = (Id) nodes.size();
+        nodes.push_back({kind, op, a, b, c});
+        hashes.push_back(hash);
+        node_index.insert(hash, id);
+        return id;
+    }
 
-    Node::Ptr analyse() {
-        pos = tokens.begin();
-        return move(program());
-    };
+    uint32_t add_list(const uint32_t *first, size_t count, bool of_nodes) {
+        uint64_t hash = mix(list_hash(first, count, of_nodes), of_nodes);
+        uint32_t at = list_index.find(hash, [&](uint32_t other) {
+            return lists[other] == count && std::equal(first, first + count, lists.data() + other + 1);
+        });
+        if (at != Index::empty) return at;
+
+        at = (uint32_t) lists.size();
+        lists.push_back((uint32_t) count);
+        lists.insert(lists.end(), first, first + count);
+        list_index.insert(hash, at);
+        return at;
+    }
 
-    bool eof() { return (pos == tokens.end()); };
-};
+    List list(uint32_t at) const { return {list_view + at + 1, list_view[at]}; }
 
-/*
- * Compiler attempts to turn a parse tree generated in Syntaxer to the string result, if semantically correct.
- */
-class Compiler {
+    bool verify(uint32_t symbols) const;
 
-    std::stringstream os_temp;
-    std::ostream *os;
-    Syntaxer::Node::Ptr parse_tree;
-    std::map<string, int> func_idents = {};
-    std::set<string> var_idents;
+    bool expand(Syntaxer::Node::ConstPtr node, std::vector<Syntaxer::Node::ConstPtr> &parts) const;
 
-    const string number = "number";
-    const string ws = " ";
-    const string lbrace = "{";
-    const string rbrace = "}";
-    const string lparen = "(";
-    const string rparen = ")";
-    const string comma = ",";
-    const string semicolon = ";";
-    const string return_sym = "return";
-    const string exp_pro = "[&](){" + return_sym + ws;
-    const string exp_epi = ";}()";
+    Id build(Syntaxer::Node::ConstPtr node, const Id *parts, size_t count);
 
 public:
+    // replaces the Ast by one built from a parse tree, which is only read and so can be lowered again or used
+    // otherwise; fails once the Ast has more nodes than the budget allows
+    bool lower(const Syntaxer::Node &program, Budget *budget = nullptr);
+
+    // the same in steps, for a caller that lowers each top-level function as soon as it is parsed and then frees
+    // its parse tree: clear, lower_function for every function in source order, then seal
+    void clear();
+
+    bool lower_function(Syntaxer::Node::ConstPtr function, Budget *budget = nullptr);
+
+    void seal();
+
+    /*
+     * Cache file - the Ast and the names of its symbols, for a later run over the same source to skip lexing and
+     * parsing. It is read in place from a mapped file and holds native integers:
+     *     CacheHeader | nodes | hashes | lists | functions | name offsets (symbols + 1) | names
+     * every section padded to 8 bytes. The source is identified by its size and content hash, the file itself by
+     * payload_hash, and a change of layout or byte order by version and magic.
+     */
+    struct CacheHeader {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t symbols;
+        uint64_t source_size;
+        uint64_t source_hash;
+        uint64_t payload_hash;
+        uint64_t nodes;
+        uint64_t lists;
+        uint64_t functions;
+        uint64_t names;  // bytes
+    };
 
-    Compiler(Syntaxer::Node::Ptr tree, std::ostream *os) {
-        this->os = os;
-        this->parse_tree = move(tree);
+    static constexpr uint64_t cache_magic = 0x0a54534148535323;  // "#SSHAST\n"
+    static constexpr uint32_t cache_version = 1;
+
+    static uint64_t content_hash(const char *data, size_t size) {
+        uint64_t hash = size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            hash = mix(hash, word);
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, data + i, size - i);
+        return mix(hash, tail);
     }
 
-private:
+    // writes the cache through a temporary file, so readers only ever map a complete one
+    bool save(const string &file_name, const Source &source, const Interner &symbols) const;
 
+    // takes the Ast from a mapped cache file that must outlive it; symbols must still be empty
+    bool load(const Source &cache, const Source &source, Interner &symbols);
 
-    bool logical_operation(Syntaxer::Node::Ptr node) {
-        if (node == nullptr || node->next.size() != 2) return false;
+    // the top-level functions in source order
+    List program() const { return {function_view, function_count}; }
 
-        os_temp << node->next[0]->value();
-        return expression(move(node->next[1]));
-    }
+    size_t size() const { return node_count; }
 
-    bool condition(Syntaxer::Node::Ptr node) {
-        bool res = true;
-        if (node == nullptr) return false;
-        if (node->next.empty()) return false;
+    Kind kind(Id node) const { return node_view[node].kind; }
 
-        int neg = 0;
+    // structural - equal for equal subtrees, also across different Asts over the same Interner
+    uint64_t hash(Id node) const { return hash_view[node]; }
 
-        if (node->next[0]->token.type == Lexer::negation) {
-            os_temp << "!";
-            neg++;
-        }
+    uint32_t name(Id function) const { return node_view[function].a; }
 
-        os_temp << lparen;
+    List params(Id function) const { return list(node_view[function].b); }
 
-        res &= expression(move(node->next[0 + neg]));
+    Id body(Id function) const { return node_view[function].c; }
 
-        if (node->next.size() == 2)
-            res &= logical_operation(move(node->next[1 + neg]));
+    uint32_t callee(Id call) const { return node_view[call].a; }
 
-        os_temp << rparen;
+    List args(Id call) const { return list(node_view[call].b); }
 
-        return res;
-    }
+    Id condition(Id conditional) const { return node_view[conditional].a; }
 
-    bool conditional_expression(Syntaxer::Node::Ptr node) {
-        bool res = true;
-        if (node == nullptr) return false;
-        if (node->next.size() != 6) return false;
+    bool negated(Id conditional) const { return node_view[conditional].op == Lexer::negation; }
 
-        os_temp << lparen;
-        os_temp << lparen;
-        res &= expression(move(node->next[2]));
-        os_temp << rparen;
-        os_temp << "?";
-        res &= body(move(node->next[4]));
-        os_temp << ":";
-        res &= body(move(node->next[5]));
-        os_temp << rparen;
+    Id then_branch(Id conditional) const { return node_view[conditional].b; }
 
-        return res;
+    Id else_branch(Id conditional) const { return node_view[conditional].c; }
+
+    // a whole run a op b op c ..., operators()[i] standing between operands()[i] and operands()[i + 1]
+    List operands(Id binary) const { return list(node_view[binary].a); }
+
+    List operators(Id binary) const { return list(node_view[binary].b); }
+
+    // the expressions of a block, evaluated in order
+    List items(Id seq) const { return list(node_view[seq].a); }
+
+    // the expression inside parentheses
+    Id inner(Id group) const { return node_view[group].a; }
+
+    uint32_t symbol(Id var) const { return node_view[var].a; }
+
+    uint64_t value(Id lit) const { return (uint64_t) node_view[lit].b << 32 | node_view[lit].c; }
+
+    static string_view spelling(Lexer::Type op) {
+        switch (op) {
+            case Lexer::times: return "*";
+            case Lexer::slash: return "/";
+            case Lexer::plus: return "+";
+            case Lexer::minus: return "-";
+            case Lexer::mod: return "%";
+            case Lexer::andsym: return "&&";
+            case Lexer::orsym: return "||";
+            case Lexer::eql: return "==";
+            case Lexer::neq: return "!=";
+            case Lexer::lss: return "<";
+            case Lexer::gtr: return ">";
+            default: return "";
+        }
     }
+};
+
+bool Ast::lower(const Syntaxer::Node &program, Budget *budget) {
+    clear();
+    for (auto function : program.next)
+        if (!lower_function(function, budget)) return false;
+    seal();
+    return true;
+}
+
+void Ast::clear() {
+    nodes.clear();
+    hashes.clear();
+    lists.clear();
+    functions.clear();
+    node_index = {};
+    list_index = {};
+}
 
-    bool binary_operator(Syntaxer::Node::Ptr node) {
-        if (node == nullptr || node->next.size() != 2) return false;
+/*
+ * Lowering walks the parse tree with an explicit stack, so any depth the parser accepts is fine. A frame is expanded
+ * into the parse nodes it is built from, and built once their Ast ids are on the result stack. An expression without
+ * an operator is replaced by its operand and costs no Ast node.
+ */
+bool Ast::lower_function(Syntaxer::Node::ConstPtr function, Budget *budget) {
+    struct Frame {
+        Syntaxer::Node::ConstPtr node;
+        bool expanded;
+        size_t base;  // its parts' results start here
+    };
 
-        os_temp << node->next[0]->value();
-        return expression(move(node->next[1]));
+    std::vector<Frame> stack{{function, false, 0}};
+    std::vector<Id> results;
+    std::vector<Syntaxer::Node::ConstPtr> parts;
+
+    while (!stack.empty()) {
+        if (budget != nullptr && budget->over(nodes.size(), budget->nodes, "Ast nodes")) return false;
+        Frame &frame = stack.back();
+        Syntaxer::Node::ConstPtr node = frame.node;
+
+        if (frame.expanded) {
+            size_t base = frame.base;
+            stack.pop_back();
+            Id id = build(node, results.data() + base, results.size() - base);
+            results.resize(base);
+            results.push_back(id);
+        } else if (node->type == Syntaxer::Node::generic && node->next.size() == 1) {
+            frame.node = node->next[0];
+        } else if (node->is_terminal()) {
+            stack.pop_back();
+            if (node->token.type == Lexer::ident) results.push_back(add(var, 0, node->token.symbol));
+            else if (node->token.type == Lexer::number)
+                results.push_back(add(lit, 0, 0, (uint32_t) (node->token.literal >> 32),
+                                      (uint32_t) node->token.literal));
+            else return false;
+        } else {
+            frame.expanded = true;
+            frame.base = results.size();
+            parts.clear();
+            if (!expand(node, parts)) return false;
+            for (size_t k = parts.size(); k-- > 0;) stack.push_back({parts[k], false, 0});
+        }
     }
+    functions.push_back(results.back());
+    return true;
+}
 
-    bool value(Syntaxer::Node::Ptr node) {
-        if (node == nullptr) return false;
+void Ast::seal() {
+    node_index = {};
+    list_index = {};
+
+    node_view = nodes.data();
+    hash_view = hashes.data();
+    list_view = lists.data();
+    function_view = functions.data();
+    node_count = nodes.size();
+    list_count = lists.size();
+    function_count = functions.size();
+}
 
-        if (node->token.type == Lexer::Type::ident) {
-            auto val = node->value();
-            auto ret = var_idents.find(val);
-            if (ret == var_idents.end()) return false;
-            os_temp << val;
+// the parse nodes that node is built from, in order
+bool Ast::expand(Syntaxer::Node::ConstPtr node, std::vector<Syntaxer::Node::ConstPtr> &parts) const {
+    switch (node->type) {
+        case Syntaxer::Node::function:
+            parts.push_back(node->next[2]);
+            return true;
+        case Syntaxer::Node::body:
+            for (size_t i = 0; i < node->next[1]->next.size(); i += 2) parts.push_back(node->next[1]->next[i]);
+            return true;
+        case Syntaxer::Node::group:
+            parts.push_back(node->next[1]);
+            return true;
+        case Syntaxer::Node::function_call:
+            for (size_t i = 0; i < node->next[2]->next.size(); i += 2) parts.push_back(node->next[2]->next[i]);
             return true;
-        } else if (node->token.type == Lexer::Type::number) {
-            os_temp << lparen << number << rparen << node->value();
+        case Syntaxer::Node::conditional_expression: {
+            // ( [!] expression [logical_operation] ) body body
+            Syntaxer::Node::ConstPtr condition = node->next[2];
+            size_t neg = condition->next[0]->token.type == Lexer::negation;
+            parts.push_back(condition->next[neg]);
+            if (condition->next.size() > neg + 1) parts.push_back(condition->next[neg + 1]->next[1]);
+            parts.push_back(node->next[4]);
+            parts.push_back(node->next[5]);
             return true;
         }
-        return false;
+        case Syntaxer::Node::generic:
+            // operand binary_operation, where the binary_operation nests the rest of the run to the right
+            if (node->next.size() != 2) return false;
+            for (; node->next.size() == 2; node = node->next[1]->next[1]) parts.push_back(node->next[0]);
+            parts.push_back(node->next[0]);
+            return true;
+        default:
+            return false;
     }
+}
 
-    bool params_call(Syntaxer::Node::Ptr node, int &num_params) {
-        bool res = true;
-        if (node == nullptr) return false;
+Ast::Id Ast::build(Syntaxer::Node::ConstPtr node, const Id *parts, size_t count) {
+    switch (node->type) {
+        case Syntaxer::Node::function: {
+            std::vector<uint32_t> params;
+            for (auto param : node->next[1]->next) params.push_back(param->token.symbol);
+            return add(function, 0, node->next[0]->token.symbol, add_list(params.data(), params.size(), false),
+                       parts[0]);
+        }
+        case Syntaxer::Node::body:
+            return add(seq, 0, add_list(parts, count, true));
+        case Syntaxer::Node::group:
+            return add(group, 0, parts[0]);
+        case Syntaxer::Node::function_call:
+            return add(call, 0, node->next[0]->token.symbol, add_list(parts, count, true));
+        case Syntaxer::Node::conditional_expression: {
+            Syntaxer::Node::ConstPtr condition = node->next[2];
+            bool neg = condition->next[0]->token.type == Lexer::negation;
+            Id test = parts[0];
+            if (count == 4) {
+                uint32_t op = condition->next[neg + 1]->next[0]->token.type;
+                test = add(binary, 0, add_list(parts, 2, true), add_list(&op, 1, false));
+            }
+            return add(conditional, neg ? Lexer::negation : 0, test, parts[count - 2], parts[count - 1]);
+        }
+        default: {
+            std::vector<uint32_t> ops;
+            for (; node->next.size() == 2; node = node->next[1]->next[1])
+                ops.push_back(node->next[1]->next[0]->token.type);
+            return add(binary, 0, add_list(parts, count, true), add_list(ops.data(), ops.size(), false));
+        }
+    }
+}
 
-        num_params = 0;
+bool Ast::save(const string &file_name, const Source &source, const Interner &symbols) const {
+    static_assert(sizeof(Node) == 16 && sizeof(CacheHeader) % 8 == 0, "cache layout");
 
-        os_temp << lparen;
-        for (int i = 0; i < node->next.size(); i = i + 2) {
-            res &= expression(move(node->next[i]));
-            if (i < node->next.size() - 1)
-                os_temp << comma;
-            num_params++;
+    string payload;
+    auto section = [&](const void *data, size_t bytes) {
+        payload.append((const char *) data, bytes);
+        payload.resize((payload.size() + 7) & ~(size_t) 7);
+    };
+
+    std::vector<uint32_t> offsets{0};
+    string names;
+    for (uint32_t id = 0; id < symbols.size(); ++id) {
+        names += symbols.name(id);
+        offsets.push_back((uint32_t) names.size());
+    }
+
+    section(node_view, node_count * sizeof(Node));
+    section(hash_view, node_count * sizeof(uint64_t));
+    section(list_view, list_count * sizeof(uint32_t));
+    section(function_view, function_count * sizeof(Id));
+    section(offsets.data(), offsets.size() * sizeof(uint32_t));
+    section(names.data(), names.size());
+
+    CacheHeader header{cache_magic, cache_version, symbols.size(), source.size(),
+                       content_hash(source.begin(), source.size()), content_hash(payload.data(), payload.size()),
+                       node_count, list_count, function_count, names.size()};
+
+    auto write_all = [](int fd, const char *data, size_t bytes) {
+        while (bytes > 0) {
+            ssize_t n = write(fd, data, bytes);
+            if (n < 0) return false;
+            data += n;
+            bytes -= (size_t) n;
         }
-        os_temp << rparen;
+        return true;
+    };
 
-        return res;
+    // a name of its own, so concurrent runs over the same file do not write into each other's temporary
+    string temp_name = file_name + ".XXXXXX";
+    int fd = mkstemp(&temp_name[0]);
+    if (fd < 0) return false;
+    bool ok = fchmod(fd, 0644) == 0 && write_all(fd, (const char *) &header, sizeof(header)) &&
+              write_all(fd, payload.data(), payload.size());
+    ok = close(fd) == 0 && ok;
+    if (!ok || std::rename(temp_name.c_str(), file_name.c_str()) != 0) {
+        std::remove(temp_name.c_str());
+        return false;
     }
+    return true;
+}
 
-    bool function_ident_call(Syntaxer::Node::Ptr node, int &num_params) {
-        bool res = true;
-        if (node == nullptr || !node->next.empty()) return false;
+bool Ast::load(const Source &cache, const Source &source, Interner &symbols) {
+    CacheHeader header{};
+    if (cache.size() < sizeof(header) || symbols.size() != 0) return false;
+    std::memcpy(&header, cache.begin(), sizeof(header));
+    if (header.magic != cache_magic || header.version != cache_version || header.source_size != source.size())
+        return false;
 
-        auto val = node->value();
-        auto ret = func_idents.find(val);
-        if (ret == func_idents.end()) return false;
-        os_temp << val;
+    // counts are checked against the file size before they are multiplied, so no section size can wrap around
+    auto padded = [](uint64_t bytes) { return (bytes + 7) & ~(uint64_t) 7; };
+    const uint64_t counts[] = {header.nodes, header.nodes, header.lists, header.functions, header.symbols + 1ull,
+                               header.names};
+    const uint64_t widths[] = {sizeof(Node), sizeof(uint64_t), sizeof(uint32_t), sizeof(Id), sizeof(uint32_t), 1};
+    uint64_t starts[6], at = sizeof(header);
+    for (int i = 0; i < 6; ++i) {
+        if (counts[i] > cache.size() / widths[i]) return false;
+        starts[i] = at;
+        at += padded(counts[i] * widths[i]);
+    }
+    if (at != cache.size() || header.nodes >= Index::empty || header.lists >= Index::empty) return false;
+
+    const char *base = cache.begin();
+    if (content_hash(base + sizeof(header), cache.size() - sizeof(header)) != header.payload_hash) return false;
+    if (content_hash(source.begin(), source.size()) != header.source_hash) return false;
+
+    auto offsets = (const uint32_t *) (base + starts[4]);
+    const char *names = base + starts[5];
+    if (offsets[0] != 0 || offsets[header.symbols] != header.names) return false;
+    for (uint32_t id = 0; id < header.symbols; ++id)
+        if (offsets[id] > offsets[id + 1]) return false;
+
+    node_view = (const Node *) (base + starts[0]);
+    hash_view = (const uint64_t *) (base + starts[1]);
+    list_view = (const uint32_t *) (base + starts[2]);
+    function_view = (const Id *) (base + starts[3]);
+    node_count = header.nodes;
+    list_count = header.lists;
+    function_count = header.functions;
+    if (!verify(header.symbols)) {
+        node_view = nullptr;
+        hash_view = nullptr;
+        list_view = nullptr;
+        function_view = nullptr;
+        node_count = list_count = function_count = 0;
+        return false;
+    }
 
-        num_params = ret->second;
+    for (uint32_t id = 0; id < header.symbols; ++id)
+        symbols.intern(string_view(names + offsets[id], offsets[id + 1] - offsets[id]));
+    return true;
+}
 
+/*
+ * Checks a loaded Ast before anything reads it through the accessors: every kind is known, every field that holds
+ * a node, list or symbol is in range for its section, and every top-level entry is a function. Lowering adds children
+ * before their parents, so a child id must also be below its parent's, which rules out cycles.
+ */
+bool Ast::verify(uint32_t symbols) const {
+    // whether at is a list whose entries are all below bound
+    auto valid_list = [&](uint32_t at, uint64_t bound) {
+        if (at >= list_count || list_view[at] >= list_count - at) return false;
+        for (uint32_t k = 0; k < list_view[at]; ++k)
+            if (list_view[at + 1 + k] >= bound) return false;
         return true;
+    };
 
+    for (Id id = 0; id < node_count; ++id) {
+        const Node &node = node_view[id];
+        if (node.kind > lit) return false;
+
+        const uint32_t fields[] = {node.a, node.b, node.c};
+        for (int f = 0; f < 3; ++f) {
+            switch (layout[node.kind][f]) {
+                case child:
+                    if (fields[f] >= id) return false;
+                    break;
+                case child_list:
+                    if (!valid_list(fields[f], id)) return false;
+                    break;
+                case scalar_list:
+                    // parameter symbols of a function, operator tokens of a binary run
+                    if (!valid_list(fields[f], node.kind == function ? symbols : Lexer::number + 1u)) return false;
+                    break;
+                case scalar:
+                    // a's scalar is a symbol for these kinds
+                    if (f == 0 && (node.kind == function || node.kind == call || node.kind == var) &&
+                        fields[f] >= symbols)
+                        return false;
+                    break;
+            }
+        }
     }
 
-    bool function_call(Syntaxer::Node::Ptr node) {
-        bool res = true;
-        if (node == nullptr || node->next.size() != 4) return false;
-        int num_params_want;
-        res &= function_ident_call(move(node->next[0]), num_params_want);
-        int num_params_got;
-        res &= params_call(move(node->next[2]), num_params_got); // TODO - check number of parameters is correct
+    for (size_t i = 0; i < function_count; ++i)
+        if (function_view[i] >= node_count || node_view[function_view[i]].kind != function) return false;
+    return true;
+}
 
-        res &= num_params_got == num_params_want;
+/*
+ * Compiler attempts to turn the Ast lowered from Syntaxer's parse tree to the string result, if semantically correct.
+ */
+class Compiler {
 
-        return res;
-    }
+    std::stringstream os_temp;
+    std::ostream *os;
+    const Ast *ast;
+    Interner *symbols;
+    Budget *budget;
+    std::vector<int> func_params;   // by symbol, number of parameters or -1 when not a function
+    std::vector<uint32_t> var_scope; // by symbol, the function whose parameter it is
+    uint32_t scope = 0;
+    uint32_t number_sym, main_sym, read_sym, write_sym;
 
-    bool group(Syntaxer::Node::Ptr node) {
-        bool res = true;
-        if (node == nullptr || node->next.size() != 3) return false;
+    const string number = "number";
+    const string ws = " ";
+    const string lbrace = "{";
+    const string rbrace = "}";
+    const string lparen = "(";
+    const string rparen = ")";
+    const string comma = ",";
+    const string semicolon = ";";
+    const string return_sym = "return";
 
-        os_temp << lparen;
-        res &= expression(move(node->next[1]));
-        os_temp << rparen;
+public:
 
-        return res;
+    Compiler(const Ast &ast, Interner &symbols, std::ostream *os, Budget *budget = nullptr) {
+        this->os = os;
+        this->ast = &ast;
+        this->symbols = &symbols;
+        this->budget = budget;
+        number_sym = symbols.intern(number);
+        main_sym = symbols.intern("main");
+        read_sym = symbols.intern("read");
+        write_sym = symbols.intern("write");
     }
 
-    bool expression(Syntaxer::Node::Ptr node) {
-        bool res = true;
-        if (node == nullptr) return false;
+private:
+
+    /*
+     * Translation still to do, next item last. Nested expressions are queued here instead of recursed into, so the
+     * depth of the tree costs no native stack: each node below emits its leading text at once and queues the rest in
+     * reverse order.
+     */
+    struct Task {
+        Ast::Id node;
+        std::string_view text;  // emitted when node is none
+    };
+    static constexpr Ast::Id none = ~(Ast::Id) 0;
+    std::vector<Task> tasks;
 
-        if (node->next.size() != 1 && node->next.size() != 2) return false;
-        if (node->next[0] == nullptr) return false;
+    // false once the code generated so far is over the output budget
+    bool within_budget() {
+        return budget == nullptr || budget->output == 0 ||
+               !budget->over((uint64_t) os_temp.tellp(), budget->output, "output bytes");
+    }
 
-        if (false) {}
-        else if (node->next[0]->type == Syntaxer::Node::body) res &= body(move(node->next[0]));
-        else if (node->next[0]->type == Syntaxer::Node::group) res &= group(move(node->next[0]));
-        else if (node->next[0]->type == Syntaxer::Node::function_call) res &= function_call(move(node->next[0]));
-        else if (node->type == Syntaxer::Node::condition) { res &= condition(move(node)); node = nullptr; }
-        else if (node->next[0]->type == Syntaxer::Node::conditional_expression)
-            res &= conditional_expression(move(node->next[0]));
-        else if (node->next[0]->type == Syntaxer::Node::basic_value) res &= value(move(node->next[0]));
-        else return false;
+    void later(Ast::Id node) { tasks.push_back({node, {}}); }
 
-        if (node != nullptr && node->next.size() == 2)
-            res &= binary_operator(move(node->next[1]));
+    void later(std::string_view text) { tasks.push_back({none, text}); }
 
-        return res;
+    // the list's expressions, separated by commas
+    void later(Ast::List list) {
+        for (size_t i = list.size(); i-- > 0;) {
+            if (i + 1 < list.size()) later(comma);
+            later(list[i]);
+        }
     }
 
-    bool body(Syntaxer::Node::Ptr node) {
+    bool translate(Ast::Id node) {
         bool res = true;
-        if (node == nullptr || node->next.size() != 3) return false;
-        node = move(node->next[1]);
-        if (node == nullptr) return false;
 
-        os_temp << lparen;
-        os_temp << exp_pro;
-        for (int i = 0; i < node->next.size(); i = i + 2) {
-            res &= expression(move(node->next[i]));
-            if (i < node->next.size() - 1)
-                os_temp << comma;
+        later(node);
+        while (!tasks.empty()) {
+            Task task = tasks.back();
+            tasks.pop_back();
+            if (task.node == none) os_temp << task.text;
+            else res &= expression(task.node);
+            if (!within_budget()) {
+                tasks.clear();
+                return false;
+            }
         }
-        os_temp << exp_epi;
-        os_temp << rparen;
 
         return res;
     }
 
-    bool var_ident(Syntaxer::Node::Ptr node) {
-        bool res = true;
-        if (node == nullptr) return false;
+    bool expression(Ast::Id node) {
+        switch (ast->kind(node)) {
+            case Ast::seq:
+                // a comma expression - bodies declare nothing, so they need no scope of their own
+                os_temp << lparen;
+                later(rparen);
+                later(ast->items(node));
+                return true;
+
+            case Ast::group:
+                os_temp << lparen;
+                later(rparen);
+                later(ast->inner(node));
+                return true;
+
+            case Ast::call: {
+                uint32_t sym = ast->callee(node);
+                int num_params = func_params[sym];
+                if (num_params >= 0) os_temp << symbols->name(sym);
+                os_temp << lparen;
+                later(rparen);
+                later(ast->args(node));
+                return num_params >= 0 && (size_t) num_params == ast->args(node).size();
+            }
 
-        if (node->is_terminal() && node->token.type == Lexer::ident) {
-            string v = node->value();
-            auto func_ret = func_idents.find(v);
-            if (v == number || func_ret != func_idents.end()) return false;
-            auto ret = var_idents.insert(v);
-            res &= ret.second;
-            os_temp << v;
-        }
+            case Ast::conditional:
+                os_temp << lparen << lparen;
+                if (ast->negated(node)) os_temp << "!";
+                os_temp << lparen;
+                later(rparen);
+                later(ast->else_branch(node));
+                later(":");
+                later(ast->then_branch(node));
+                later("?");
+                later(rparen);
+                later(rparen);
+                later(ast->condition(node));
+                return true;
+
+            case Ast::binary: {
+                Ast::List operands = ast->operands(node), operators = ast->operators(node);
+                for (size_t i = operators.size(); i-- > 0;) {
+                    later(operands[i + 1]);
+                    later(Ast::spelling((Lexer::Type) operators[i]));
+                }
+                later(operands[0]);
+                return true;
+            }
 
-        return res;
-    }
+            case Ast::var:
+                if (var_scope[ast->symbol(node)] != scope) return false;
+                os_temp << symbols->name(ast->symbol(node));
+                return true;
 
-    bool func_ident(Syntaxer::Node::Ptr node, int num_params) {
-        bool res = true;
-        if (node == nullptr) return false;
+            case Ast::lit:
+                os_temp << lparen << number << rparen << ast->value(node);
+                return true;
 
-        if (node->is_terminal() && node->token.type == Lexer::ident) {
-            string v = node->value();
-            auto ret = func_idents.emplace(v, num_params);
-            res &= ret.second;
-            os_temp << v;
+            default:
+                return false;
         }
+    }
 
+    bool var_ident(uint32_t sym) {
+        if (sym == number_sym || func_params[sym] >= 0) return false;
+        bool res = var_scope[sym] != scope;
+        var_scope[sym] = scope;
+        os_temp << symbols->name(sym);
         return res;
     }
 
+    bool func_ident(uint32_t sym, int num_params) {
+        bool res = func_params[sym] < 0;
+        func_params[sym] = num_params;
+        os_temp << symbols->name(sym);
+        return res;
+    }
 
-    bool function(Syntaxer::Node::Ptr node) {
+    bool function(Ast::Id node) {
         bool res = true;
-        if (node == nullptr) return false;
-        if (node->next.size() != 3) return false;
-        var_idents = {};
-
-        bool main = false;
-        if (node->next[0] != nullptr && node->next[0]->is_terminal() && node->next[0]->token.type == Lexer::ident &&
-            node->next[0]->value() == "main") {
-            main = true;
-            os_temp << "int" << ws;
-        } else
-            os_temp << number << ws;
+        scope++;
+
+        bool main = ast->name(node) == main_sym;
+        os_temp << (main ? "int" : number) << ws;
 
-        res &= func_ident(move(node->next[0]), (int) node->next[1]->next.size());
+        Ast::List params = ast->params(node);
+        res &= func_ident(ast->name(node), (int) params.size());
 
         os_temp << lparen;
-        for (int i = 0; i < node->next[1]->next.size(); ++i) {
+        for (size_t i = 0; i < params.size(); ++i) {
             os_temp << number << ws;
-            res &= var_ident(move(node->next[1]->next[i]));
-            if (i < node->next[1]->next.size() - 1)
+            res &= var_ident(params[i]);
+            if (i + 1 < params.size())
                 os_temp << comma;
         }
         os_temp << rparen;
 
         os_temp << lbrace << return_sym << ws;
-        res &= body(move(node->next[2])); // TODO
+        res &= translate(ast->body(node));
         if (main) os_temp << comma << "0";
         os_temp << semicolon << rbrace << std::endl;
 
-        var_idents = {};
         return res;
     }
 
 public:
 
+    // translates the Ast, which is only read; every call starts afresh, so it can be translated any number of times
     bool compile() {
         bool res = true;
 
+        os_temp.str({});
+        os_temp.clear();
+        tasks.clear();
+        scope = 0;
+        func_params.assign(symbols->size(), -1);
+        var_scope.assign(symbols->size(), 0);
+
         os_temp << "#include <iostream>" << std::endl;
         os_temp << std::endl;
         os_temp << "typedef uint64_t number;" << std::endl;
         os_temp << std::endl;
         os_temp << "number read(){number x; std::cin >> x;return x;}" << std::endl;
-        func_idents.emplace("read", 0);
+        func_params[read_sym] = 0;
         os_temp << "number write(number x){std::cout << x << std::endl;return x;}" << std::endl;
-        func_idents.emplace("write", 1);
-
-        for (auto &i : parse_tree->next)
-            res &= function(move(i));
-
-        string file_name = "test";
-        std::fstream of;
-        of.open(file_name + ".cpp", std::ios::out);
+        func_params[write_sym] = 1;
 
-        os_temp.clear();
-        os_temp.seekg(0, std::ios::beg);
+        for (auto function : ast->program()) {
+            res &= this->function(function);
+            if (!within_budget()) return false;
+        }
 
         if (res) {
-            of << os_temp.str();
-            of.flush();
+            *os << os_temp.str();
+            os->flush();
         } else { std::cerr << os_temp.str(); }
 
-        of.close();
-
         return res;
     }
 };
 
-int main(int argc, char **argv) {
-    std::stringstream is;
-
+struct Options {
     string file_name = "test";
+    bool pipeline = false;
+    bool stream = false;
+    unsigned jobs = 1;  // threads for lexing and parsing
+    bool packrat = false;
+    string parser = "backtracking";  // backtracking, predictive, or check to run both and compare
+    bool watch = false;
+    bool cache = false;  // keep the Ast in <file>.ast and reuse it while the file is unchanged
+    Budget budget;       // limits for each run
+};
+
+// a non-empty run of decimal digits that fits into uint64_t, and nothing else
+static bool parse_count(const char *text, uint64_t &value) {
+    if (*text == '\0') return false;
+    value = 0;
+    for (; *text != '\0'; ++text)
+        if (*text < '0' || *text > '9' || __builtin_mul_overflow(value, 10ULL, &value) ||
+            __builtin_add_overflow(value, *text - '0', &value))
+            return false;
+    return true;
+}
+
+// --max-steps=N, --max-depth=N, --max-nodes=N or --max-output=N
+static bool parse_limit(const string &arg, Budget &budget) {
+    const std::pair<string, uint64_t *> limits[] = {
+            {"--max-steps=", &budget.steps}, {"--max-depth=", &budget.depth},
+            {"--max-nodes=", &budget.nodes}, {"--max-output=", &budget.output}};
+    for (auto &limit : limits) {
+        if (arg.compare(0, limit.first.size(), limit.first) == 0)
+            return parse_count(arg.c_str() + limit.first.size(), *limit.second);
+    }
+    return false;
+}
+
+static bool parse_options(int argc, char **argv, Options &options) {
+    bool have_file = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--pipeline") options.pipeline = true;
+        else if (arg == "--stream") options.stream = true;
+        else if (arg == "--packrat") options.packrat = true;
+        else if (arg == "--watch") options.watch = true;
+        else if (arg == "--cache") options.cache = true;
+        else if (arg.compare(0, 9, "--parser=") == 0) options.parser = arg.substr(9);
+        else if (arg.compare(0, 6, "--max-") == 0) {
+            if (!parse_limit(arg, options.budget)) return false;
+        }
+        else if (arg.compare(0, 7, "--jobs=") == 0) {
+            uint64_t jobs;
+            if (!parse_count(arg.c_str() + 7, jobs) || jobs > UINT32_MAX) return false;
+            options.jobs = jobs == 0 ? std::max(1u, std::thread::hardware_concurrency()) : (unsigned) jobs;
+        }
+        else if (!have_file && (arg == "-" || arg.compare(0, 2, "--") != 0)) {
+            options.file_name = arg;
+            have_file = true;
+        } else return false;
+    }
+    if (options.parser != "backtracking" && options.parser != "predictive" && options.parser != "check") return false;
+    // the check and the incremental parser both need all tokens kept, and watching needs a file to watch
+    if ((options.watch || options.cache) && options.file_name == "-") return false;
+    if (options.watch && options.cache) return false;
+    // under --watch the second parse would reuse the trees the first one just cached and compare them with themselves
+    if (options.watch && options.parser == "check") return false;
+    return (options.parser != "check" && !options.watch) || (!options.pipeline && !options.stream);
+}
+
+template<typename L>
+static int lexical_error(const L &lexer) {
+    std::cerr << "Lexical analysis failed";
+    if (lexer.error != nullptr) std::cerr << ": " << lexer.error << " at offset " << lexer.error_offset;
+    std::cerr << std::endl;
+    return 30;
+}
 
-    std::ifstream f;
-    f.open(file_name);
+static int budget_exceeded(const Budget &budget) {
+    std::cerr << "Budget exceeded: " << budget.exceeded << std::endl;
+    return 40;
+}
+
+// lexes and parses source into tree, whose nodes tree_arena keeps alive; returns an exit code. With --stream the
+// functions are lowered into ast as they are parsed and tree is left without children.
+static int analyse(const Options &options, const Source &source, Interner &symbols, Syntaxer::FunctionCache *cache,
+                   Budget &budget, Syntaxer::Node::Ptr &tree, std::shared_ptr<Arena> &tree_arena, Ast &ast) {
+    bool parsers_agree = true;
+    bool lowered = true;  // with --stream
+    auto parse = [&](Syntaxer &syntaxer) {
+        syntaxer.packrat = options.packrat;
+        syntaxer.cache = cache;
+        syntaxer.budget = &budget;
+        syntaxer.predictive = options.parser != "backtracking";
+        Syntaxer::Node::Ptr result = syntaxer.analyse();
+        if (options.parser == "check") {
+            syntaxer.predictive = false;
+            parsers_agree = Syntaxer::same_tree(result, syntaxer.analyse());
+        }
+        tree_arena = syntaxer.arena;
+        if constexpr (Syntaxer::collect_stats) syntaxer.stats.print(std::cerr);
+        return result;
+    };
+
+    if (options.pipeline) {
+        TokenQueue queue;
+        Lexer lexer(source.begin(), source.end(), symbols);
+        bool lexed = false;
+        std::thread lexer_thread([&]() { lexed = lexer.analyse(queue); });
+
+        Syntaxer syntaxer(queue);
+        tree = parse(syntaxer);
+        queue.cancel();
+        lexer_thread.join();
+
+        if (!lexed) return lexical_error(lexer);
+    } else if (options.stream) {
+        Lexer lexer(source.begin(), source.end(), symbols);
+        Syntaxer syntaxer(lexer, source.begin());
+        ast.clear();
+        // a function that cannot be lowered fails compilation rather than the parse, so parsing goes on and a later
+        // syntax error is still reported first, as when the whole tree is lowered after parsing
+        syntaxer.sink = [&](Syntaxer::Node::ConstPtr function) {
+            lowered = lowered && ast.lower_function(function, &budget);
+            return budget.exceeded == nullptr;
+        };
+        tree = parse(syntaxer);
+        ast.seal();
+
+        if (!lexer.finish()) return lexical_error(lexer);
+    } else if (options.jobs > 1) {
+        ParallelLexer lexer(source.begin(), source.end(), options.jobs);
+        TokenStream tokens(source.begin());
+        if (!lexer.analyse(tokens, symbols)) return lexical_error(lexer);
+
+        Syntaxer syntaxer(move(tokens));
+        syntaxer.jobs = options.jobs;
+        tree = parse(syntaxer);
+    } else {
+        auto lexer = std::make_unique<Lexer>(source.begin(), source.end(), symbols);
+        TokenStream tokens(source.begin());
+        if (lexer->analyse(tokens))
+            lexer.reset();
+        else
+            return lexical_error(*lexer);
+
+        Syntaxer syntaxer(move(tokens));
+        tree = parse(syntaxer);
+    }
 
-    char c;
-    while (f.get(c)) is.put(c);
+    if (budget.exceeded != nullptr) return budget_exceeded(budget);
 
-    auto lexer = std::make_unique<Lexer>(is);
-    std::vector<Lexer::Token> tokens;
-    if (lexer->analyse(tokens))
-        lexer.reset();
-    else{
-        std::cerr << "Lexical analysis failed" << std::endl;
-        return 30;
+    if (!parsers_agree) {
+        std::cerr << "Parser check failed: predictive and backtracking trees differ" << std::endl;
+        return 20;
     }
 
-    Syntaxer syntaxer(move(tokens));
-    Syntaxer::Node::Ptr tree = syntaxer.analyse();
     if (tree == nullptr)
     {
         std::cerr << "Syntax analysis failed" << std::endl;
         return 20;
     }
 
-    std::fstream of;
-    of.open(file_name + ".cpp", std::ios::out);
-    if (!of) { std::cerr << "Open output failed"; return 100; }
+    if (!lowered) {
+        std::cerr << "Compilation failed" << std::endl;
+        return 10;
+    }
+
+    return 0;
+}
+
+// one run of the whole front end and the Compiler; cache is set in watch mode
+static int transpile(const Options &options, Interner &symbols, Syntaxer::FunctionCache *cache) {
+    string file_name = options.file_name;
+
+    Source source(file_name, cache == nullptr);
+    if (!source.valid()) { std::cerr << "Open input failed" << std::endl; return 100; }
 
-    Compiler compiler(move(tree), &of);
-    of.close();
+    Budget budget = options.budget;
+    Ast ast;
+    std::unique_ptr<Source> cached;  // holds the storage of an Ast loaded from the cache file
+    if (options.cache) {
+        cached = std::make_unique<Source>(file_name + ".ast");
+        if (!cached->valid() || !ast.load(*cached, source, symbols)) cached.reset();
+        else if (budget.over(ast.size(), budget.nodes, "Ast nodes")) return budget_exceeded(budget);
+    }
+
+    Syntaxer::Node::Ptr tree = nullptr;
+    std::shared_ptr<Arena> tree_arena;
+    if (cached == nullptr) {
+        int rc = analyse(options, source, symbols, cache, budget, tree, tree_arena, ast);
+        if (rc != 0) return rc;
+    }
+
+    std::fstream of;
+    std::ostream *os = &std::cout;
+    if (file_name != "-") {
+        of.open(file_name + ".cpp", std::ios::out);
+        if (!of) { std::cerr << "Open output failed"; return 100; }
+        os = &of;
+    }
 
-    bool res = compiler.compile();
+    bool res = cached != nullptr || options.stream || ast.lower(*tree, &budget);
+    if (res && options.cache && cached == nullptr && !ast.save(file_name + ".ast", source, symbols))
+        std::cerr << "Writing the Ast cache failed" << std::endl;
+    if (res) {
+        Compiler compiler(ast, symbols, os, &budget);
+        res = compiler.compile();
+    }
+    if (budget.exceeded != nullptr) return budget_exceeded(budget);
     if (!res) { std::cerr << "Compilation failed" << std::endl; return 10; }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--pipeline | --stream | --jobs=N] [--packrat]"
+                  << " [--parser=backtracking|predictive|check] [--watch | --cache]"
+                  << " [--max-steps=N] [--max-depth=N] [--max-nodes=N] [--max-output=N] [file | -]" << std::endl;
+        return 100;
+    }
+
+    Interner symbols;
+    if (!options.watch) return transpile(options, symbols, nullptr);
+
+    // watch mode - transpile again whenever the file changes, parsing only the functions that did
+    Syntaxer::FunctionCache cache;
+    struct stat seen{};
+    while (true) {
+        struct stat now{};
+        if (stat(options.file_name.c_str(), &now) == 0 &&
+            (now.st_mtim.tv_sec != seen.st_mtim.tv_sec || now.st_mtim.tv_nsec != seen.st_mtim.tv_nsec ||
+             now.st_size != seen.st_size)) {
+            seen = now;
+            if (transpile(options, symbols, &cache) == 0)
+                std::cerr << options.file_name << ".cpp updated, parsed " << cache.reparsed << " of "
+                          << cache.functions.size() << " functions" << std::endl;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    }
+}
@@ -0,0 +1,76 @@
+# Runs the predictive and the backtracking parser over the corpus with --parser=check, with and without --packrat.
+# Programs under valid/ must transpile; programs under invalid/ must fail in syntax analysis, with both parsers
+# rejecting them. A generated program large enough to be lexed in chunks and parsed in batches must then give the
+# same output with --jobs, with either parser, and with --stream or --pipeline as in a plain serial run.
+#     cmake -DTRANSPILER=<path to S_> -DCORPUS=<this directory> -P check.cmake
+
+file(GLOB valid "${CORPUS}/valid/*.ss")
+file(GLOB invalid "${CORPUS}/invalid/*.ss")
+set(failures 0)
+
+foreach (program IN LISTS valid invalid)
+    foreach (flags IN ITEMS "" "--packrat")
+        execute_process(COMMAND "${TRANSPILER}" --parser=check ${flags} -
+                        INPUT_FILE "${program}" OUTPUT_QUIET ERROR_VARIABLE errors RESULT_VARIABLE rc)
+        list(FIND invalid "${program}" expect_failure)
+        if (expect_failure EQUAL -1)
+            set(ok 0)
+            if (rc EQUAL 0)
+                set(ok 1)
+            endif ()
+        else ()
+            set(ok 0)
+            if (rc EQUAL 20 AND errors MATCHES "Syntax analysis failed")
+                set(ok 1)
+            endif ()
+        endif ()
+        if (NOT ok)
+            message(SEND_ERROR "${program} ${flags}: exit code ${rc}\n${errors}")
+            math(EXPR failures "${failures} + 1")
+        endif ()
+    endforeach ()
+endforeach ()
+
+# a chain of functions, each calling the one before, at a few hundred KiB and well over 16384 tokens; identifiers
+# are letters only, so function numbers are spelled with the digits 0-9 mapped to a-j
+function(spell number out)
+    set(name "f${number}")
+    foreach (digit RANGE 9)
+        string(SUBSTRING "abcdefghij" ${digit} 1 letter)
+        string(REPLACE "${digit}" "${letter}" name "${name}")
+    endforeach ()
+    set(${out} "${name}" PARENT_SCOPE)
+endfunction ()
+
+set(program "fa a b { a + b }\n")
+foreach (i RANGE 1 6000)
+    math(EXPR prev "${i} - 1")
+    spell(${i} name)
+    spell(${prev} callee)
+    string(APPEND program "${name} a b { if (!(a > ${i}) && b) {${callee}(a, b) * ${i}} {(b - ${i}) % 7; {a; b}} }\n")
+endforeach ()
+spell(6000 last)
+string(APPEND program "main { write(${last}(read(), read())) }\n")
+set(large "${CMAKE_CURRENT_BINARY_DIR}/parallel.ss")
+file(WRITE "${large}" "${program}")
+
+execute_process(COMMAND "${TRANSPILER}" -
+                INPUT_FILE "${large}" OUTPUT_VARIABLE serial ERROR_VARIABLE errors RESULT_VARIABLE rc)
+if (NOT rc EQUAL 0)
+    message(SEND_ERROR "${large}: exit code ${rc}\n${errors}")
+    math(EXPR failures "${failures} + 1")
+endif ()
+
+foreach (flags IN ITEMS "--jobs=4" "--jobs=4 --parser=predictive" "--jobs=4 --packrat" "--stream" "--pipeline")
+    separate_arguments(args UNIX_COMMAND "${flags}")
+    execute_process(COMMAND "${TRANSPILER}" ${args} -
+                    INPUT_FILE "${large}" OUTPUT_VARIABLE output ERROR_VARIABLE errors RESULT_VARIABLE rc)
+    if (NOT rc EQUAL 0 OR NOT output STREQUAL serial)
+        message(SEND_ERROR "${large} ${flags}: exit code ${rc}, output differs from the serial run\n${errors}")
+        math(EXPR failures "${failures} + 1")
+    endif ()
+endforeach ()
+
+if (failures GREATER 0)
+    message(FATAL_ERROR "${failures} parser check(s) failed")
+endif ()